@@ -22,5 +22,15 @@ if [ ! -d $DIR/deps/bamtools/build ]; then
     cmake .. && make
 fi
 
-
-
+# libdeflate is optional: "build_deps.sh libdeflate" builds it for -DUSE_LIBDEFLATE=ON
+if [ "$1" == "libdeflate" ] && [ ! -d $DIR/deps/libdeflate/lib ]; then
+    mkdir -p $DIR/deps
+    if [ ! -d $DIR/deps/libdeflate-src ]; then
+        git clone --branch v1.19 --depth 1 https://github.com/ebiggers/libdeflate.git $DIR/deps/libdeflate-src
+    fi
+    cd $DIR/deps/libdeflate-src
+    cmake -B build -DCMAKE_INSTALL_PREFIX=$DIR/deps/libdeflate -DCMAKE_INSTALL_LIBDIR=lib \
+          -DLIBDEFLATE_BUILD_SHARED_LIB=OFF -DLIBDEFLATE_BUILD_GZIP=OFF -DCMAKE_POSITION_INDEPENDENT_CODE=ON \
+        && cmake --build build && cmake --install build
+    cd $DIR
+fi
@@ -0,0 +1,145 @@
+//
+// Incremental BAI index construction for ClosingBamWriter.
+//
+
+#include <fstream>
+#include "BaiIndex.h"
+
+static const uint32_t BAI_METADATA_BIN = 37450;
+static const int BAI_LINEAR_SHIFT = 14;
+
+template <typename T>
+static void write_value(std::ofstream &out, T value) {
+    out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+BaiIndexBuilder::BaiIndexBuilder(size_t n_references) : references(n_references) {}
+
+bool BaiIndexBuilder::IsValid() const {
+    return valid;
+}
+
+// begin and end are the offsets of the first byte of the record and of the
+// byte following it. Records must arrive in coordinate order, with unplaced
+// reads last; otherwise the index is marked invalid.
+void BaiIndexBuilder::AddRecord(int32_t ref_id, int32_t position, int32_t end_position, uint16_t bin,
+                                bool mapped, uint64_t begin, uint64_t end) {
+    if (!valid) return;
+
+    if (ref_id < 0) {
+        FinishReference();
+        unplaced = true;
+        ++n_no_coordinate;
+        return;
+    }
+
+    if (unplaced || size_t(ref_id) >= references.size() || ref_id < last_ref_id ||
+        (ref_id == last_ref_id && position < last_position)) {
+        valid = false;
+        return;
+    }
+
+    if (ref_id != current_ref) {
+        FinishReference();
+        current_ref = last_ref_id = ref_id;
+        references[ref_id].used = true;
+        references[ref_id].begin = begin;
+    }
+    Reference &ref = references[ref_id];
+
+    if (!in_bin || bin != current_bin) {
+        FinishBin();
+        in_bin = true;
+        current_bin = bin;
+        bin_begin = begin;
+    }
+
+    // As in samtools, placed unmapped reads get linear index entries too,
+    // covering just their position, so a region query finds them with their mates
+    int32_t start = position < 0 ? 0 : position;
+    int32_t stop = mapped && end_position > start ? end_position : start + 1;
+    size_t first = size_t(start) >> BAI_LINEAR_SHIFT;
+    size_t last = size_t(stop - 1) >> BAI_LINEAR_SHIFT;
+    if (ref.intervals.size() <= last) ref.intervals.resize(last + 1, 0);
+    for (size_t i = first; i <= last; ++i) {
+        if (ref.intervals[i] == 0) ref.intervals[i] = begin;
+    }
+    if (mapped) ++ref.n_mapped;
+    else ++ref.n_unmapped;
+
+    last_position = position;
+    last_end = end;
+    ref.end = end;
+}
+
+// Closes the chunk of the current bin, merging it with the previous chunk of
+// that bin when both touch the same BGZF block
+void BaiIndexBuilder::FinishBin() {
+    if (!in_bin) return;
+    auto &chunks = references[current_ref].bins[current_bin];
+    if (!chunks.empty() && (chunks.back().end >> 16) == (bin_begin >> 16)) {
+        chunks.back().end = last_end;
+    }
+    else {
+        chunks.emplace_back(bin_begin, last_end);
+    }
+    in_bin = false;
+}
+
+void BaiIndexBuilder::FinishReference() {
+    if (current_ref < 0) return;
+    FinishBin();
+    // Windows before the first read start at the reference's first record, and
+    // later empty ones at the window before, as samtools fills them
+    auto &intervals = references[current_ref].intervals;
+    for (size_t i = 0; i < intervals.size(); ++i) {
+        if (intervals[i] == 0) intervals[i] = i > 0 ? intervals[i - 1] : references[current_ref].begin;
+    }
+    current_ref = -1;
+}
+
+bool BaiIndexBuilder::Write(const std::string &filename, const std::vector<uint64_t> &block_offsets) {
+    FinishReference();
+    if (!valid) return false;
+
+    bool resolved = true;
+    auto resolve = [&](uint64_t offset) -> uint64_t {
+        size_t block = offset >> 16;
+        if (block >= block_offsets.size()) {
+            resolved = false;
+            return 0;
+        }
+        return block_offsets[block] << 16 | (offset & 0xffff);
+    };
+
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    if (!out) return false;
+
+    out.write("BAI\1", 4);
+    write_value<int32_t>(out, references.size());
+    for (const auto &ref : references) {
+        write_value<int32_t>(out, ref.bins.size() + (ref.used ? 1 : 0));
+        for (const auto &bin : ref.bins) {
+            write_value<uint32_t>(out, bin.first);
+            write_value<int32_t>(out, bin.second.size());
+            for (const auto &chunk : bin.second) {
+                write_value<uint64_t>(out, resolve(chunk.begin));
+                write_value<uint64_t>(out, resolve(chunk.end));
+            }
+        }
+        if (ref.used) {
+            write_value<uint32_t>(out, BAI_METADATA_BIN);
+            write_value<int32_t>(out, 2);
+            write_value<uint64_t>(out, resolve(ref.begin));
+            write_value<uint64_t>(out, resolve(ref.end));
+            write_value<uint64_t>(out, ref.n_mapped);
+            write_value<uint64_t>(out, ref.n_unmapped);
+        }
+        write_value<int32_t>(out, ref.intervals.size());
+        for (auto offset : ref.intervals) {
+            write_value<uint64_t>(out, resolve(offset));
+        }
+    }
+    write_value<uint64_t>(out, n_no_coordinate);
+    return resolved && bool(out);
+}
@@ -0,0 +1,62 @@
+//
+// Incremental BAI index construction for ClosingBamWriter.
+//
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifndef _BAIINDEX_H
+#define _BAIINDEX_H
+
+// Builds a standard BAI index from the records of a coordinate-sorted BAM as
+// they are written, in the same layout samtools produces (including the
+// per-reference metadata pseudo-bin and the unplaced read count).
+//
+// Offsets passed to AddRecord may be deferred virtual offsets, of the form
+// (block number << 16 | offset in block), for writers that don't know the
+// compressed size of a block until it has been deflated. They are translated
+// to file offsets in Write using the list of block start offsets.
+class BaiIndexBuilder {
+public:
+    BaiIndexBuilder(size_t n_references);
+    void AddRecord(int32_t ref_id, int32_t position, int32_t end_position, uint16_t bin, bool mapped,
+                   uint64_t begin, uint64_t end);
+    bool IsValid() const;
+    bool Write(const std::string &filename, const std::vector<uint64_t> &block_offsets);
+
+private:
+    struct Chunk {
+        Chunk(uint64_t begin, uint64_t end) : begin(begin), end(end) {}
+        uint64_t begin;
+        uint64_t end;
+    };
+
+    struct Reference {
+        std::map<uint32_t, std::vector<Chunk>> bins;
+        std::vector<uint64_t> intervals;
+        uint64_t begin = 0;
+        uint64_t end = 0;
+        uint64_t n_mapped = 0;
+        uint64_t n_unmapped = 0;
+        bool used = false;
+    };
+
+    void FinishBin();
+    void FinishReference();
+
+    std::vector<Reference> references;
+    uint64_t n_no_coordinate = 0;
+    bool valid = true;
+
+    int32_t current_ref = -1;
+    int32_t last_ref_id = -1;
+    int32_t last_position = -1;
+    bool unplaced = false;
+    uint32_t current_bin = 0;
+    bool in_bin = false;
+    uint64_t bin_begin = 0;
+    uint64_t last_end = 0;
+};
+
+#endif //_BAIINDEX_H
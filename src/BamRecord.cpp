@@ -0,0 +1,105 @@
+//
+// Serialised BAM records, passed from ClosingBamReader to ClosingBamWriter without decoding.
+//
+
+#include "BamRecord.h"
+
+const char *const CIGAR_OPERATIONS = "MIDNSHP=X";
+const char *const SEQUENCE_BASES = "=ACMGRSVTWYHKDBN";
+
+// Checks that the variable-length fields declared in the core fit in size bytes
+bool is_valid_record(const char *data, uint32_t size) {
+    if (size < 32) return false;
+    const uint64_t name_length = uint8_t(data[8]);
+    const uint64_t cigar_length = unpack<uint16_t>(data + 12);
+    const int32_t length = unpack<int32_t>(data + 16);
+    if (name_length == 0 || length < 0) return false;
+    return 32 + name_length + 4 * cigar_length + (uint64_t(length) + 1) / 2 + uint64_t(length) <= size;
+}
+
+// End of the alignment on the reference, calculated as BamAlignment::GetEndPosition
+int32_t record_end_position(const char *data) {
+    int32_t end = unpack<int32_t>(data + 4);
+    const uint16_t cigar_length = unpack<uint16_t>(data + 12);
+    const char *cigar = data + 32 + uint8_t(data[8]);
+    for (uint16_t i = 0; i < cigar_length; ++i, cigar += 4) {
+        uint32_t op = unpack<uint32_t>(cigar);
+        switch (op & 0xf) {
+            case 0: // M
+            case 2: // D
+            case 3: // N
+            case 7: // =
+            case 8: // X
+                end += op >> 4;
+                break;
+            default:
+                break;
+        }
+    }
+    return end;
+}
+
+// Decodes the fixed-length fields and CIGAR, and returns a pointer to the
+// sequence that follows
+static const char * decode_core(const char *data, BamTools::BamAlignment &alignment) {
+    alignment.RefID = unpack<int32_t>(data);
+    alignment.Position = unpack<int32_t>(data + 4);
+    const uint8_t name_length = uint8_t(data[8]);
+    alignment.MapQuality = uint8_t(data[9]);
+    alignment.Bin = unpack<uint16_t>(data + 10);
+    const uint16_t cigar_length = unpack<uint16_t>(data + 12);
+    alignment.AlignmentFlag = unpack<uint16_t>(data + 14);
+    alignment.Length = unpack<int32_t>(data + 16);
+    alignment.MateRefID = unpack<int32_t>(data + 20);
+    alignment.MatePosition = unpack<int32_t>(data + 24);
+    alignment.InsertSize = unpack<int32_t>(data + 28);
+
+    const char *p = data + 32 + name_length;
+    alignment.CigarData.clear();
+    alignment.CigarData.reserve(cigar_length);
+    for (uint16_t i = 0; i < cigar_length; ++i, p += 4) {
+        uint32_t op = unpack<uint32_t>(p);
+        alignment.CigarData.emplace_back((op & 0xf) < 9 ? CIGAR_OPERATIONS[op & 0xf] : '?', op >> 4);
+    }
+    return p;
+}
+
+// Like BamReader::GetNextAlignmentCore, leaves the name, sequence, qualities
+// and tags empty. Only the core and CIGAR are read, which is_valid_record has
+// checked fit in the record.
+void decode_record_core(const char *data, BamTools::BamAlignment &alignment) {
+    decode_core(data, alignment);
+    alignment.Name.clear();
+    alignment.QueryBases.clear();
+    alignment.Qualities.clear();
+    alignment.TagData.clear();
+    alignment.AlignedBases.clear();
+}
+
+void decode_record(const char *data, uint32_t size, BamTools::BamAlignment &alignment) {
+    const char *p = decode_core(data, alignment);
+    const uint32_t length = uint32_t(alignment.Length);
+    alignment.Name.assign(data + 32, uint8_t(data[8]) - 1);
+
+    alignment.QueryBases.resize(length);
+    for (uint32_t i = 0; i < length; ++i) {
+        uint8_t packed = uint8_t(p[i / 2]);
+        alignment.QueryBases[i] = SEQUENCE_BASES[(i % 2 == 0) ? packed >> 4 : packed & 0xf];
+    }
+    p += (length + 1) / 2;
+
+    // Missing qualities are stored as 0xFF and kept as-is, as BamTools does
+    if (length > 0 && uint8_t(p[0]) == 0xff) {
+        alignment.Qualities.assign(length, char(0xff));
+    }
+    else {
+        alignment.Qualities.resize(length);
+        for (uint32_t i = 0; i < length; ++i) {
+            alignment.Qualities[i] = char(p[i] + 33);
+        }
+    }
+    p += length;
+
+    alignment.TagData.assign(p, data + size);
+    alignment.AlignedBases.clear();
+}
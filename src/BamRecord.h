@@ -0,0 +1,100 @@
+//
+// Serialised BAM records, passed from ClosingBamReader to ClosingBamWriter without decoding.
+//
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <api/BamAlignment.h>
+
+#ifndef _BAMRECORD_H
+#define _BAMRECORD_H
+
+extern const char *const CIGAR_OPERATIONS;
+extern const char *const SEQUENCE_BASES;
+
+template <typename T>
+inline T unpack(const char *data) {
+    T value;
+    std::memcpy(&value, data, sizeof(T));
+    return value;
+}
+
+bool is_valid_record(const char *data, uint32_t size);
+int32_t record_end_position(const char *data);
+void decode_record(const char *data, uint32_t size, BamTools::BamAlignment &alignment);
+void decode_record_core(const char *data, BamTools::BamAlignment &alignment);
+
+// Accessors shared by BamRecordView and BamRecord. Record provides Data() and
+// Size() for the bytes of a BAM record as stored in the file, without its
+// leading block_size field. Core fields are read straight from the bytes, and
+// ToAlignment decodes the record fully (ToAlignmentCore all but its name,
+// sequence, qualities and tags).
+template <typename Record>
+class BamRecordFields {
+public:
+    int32_t RefID() const { return unpack<int32_t>(Bytes()); }
+    int32_t Position() const { return unpack<int32_t>(Bytes() + 4); }
+    uint16_t MapQuality() const { return uint8_t(Bytes()[9]); }
+    uint16_t Bin() const { return unpack<uint16_t>(Bytes() + 10); }
+    uint32_t AlignmentFlag() const { return unpack<uint16_t>(Bytes() + 14); }
+    int32_t Length() const { return unpack<int32_t>(Bytes() + 16); }
+    int32_t MateRefID() const { return unpack<int32_t>(Bytes() + 20); }
+    int32_t MatePosition() const { return unpack<int32_t>(Bytes() + 24); }
+    int32_t InsertSize() const { return unpack<int32_t>(Bytes() + 28); }
+
+    // NUL-terminated read name, and its length without the NUL
+    const char * Name() const { return Bytes() + 32; }
+    size_t NameLength() const { return uint8_t(Bytes()[8]) - 1; }
+
+    // Raw phred scores (no +33 offset), Length() of them; 0xFF if missing
+    const uint8_t * Qualities() const {
+        return reinterpret_cast<const uint8_t *>(Bytes()) + 32 + uint8_t(Bytes()[8]) +
+               4 * unpack<uint16_t>(Bytes() + 12) + (Length() + 1) / 2;
+    }
+
+    bool IsDuplicate() const { return (AlignmentFlag() & 0x0400) != 0; }
+    bool IsFailedQC() const { return (AlignmentFlag() & 0x0200) != 0; }
+    bool IsFirstMate() const { return (AlignmentFlag() & 0x0040) != 0; }
+    bool IsMapped() const { return (AlignmentFlag() & 0x0004) == 0; }
+    bool IsMateMapped() const { return (AlignmentFlag() & 0x0008) == 0; }
+    bool IsPaired() const { return (AlignmentFlag() & 0x0001) != 0; }
+    bool IsPrimaryAlignment() const { return (AlignmentFlag() & 0x0100) == 0; }
+    bool IsProperPair() const { return (AlignmentFlag() & 0x0002) != 0; }
+    bool IsSecondMate() const { return (AlignmentFlag() & 0x0080) != 0; }
+
+    int32_t GetEndPosition() const { return record_end_position(Bytes()); }
+    void ToAlignment(BamTools::BamAlignment &alignment) const {
+        decode_record(Bytes(), static_cast<const Record *>(this)->Size(), alignment);
+    }
+    void ToAlignmentCore(BamTools::BamAlignment &alignment) const {
+        decode_record_core(Bytes(), alignment);
+    }
+
+private:
+    const char * Bytes() const { return static_cast<const Record *>(this)->Data(); }
+};
+
+// Non-owning view of a record, usually pointing into a decompressed block
+// held by ClosingBamReader. It's only valid until the reader is next used.
+class BamRecordView : public BamRecordFields<BamRecordView> {
+public:
+    BamRecordView(const char *data = nullptr, uint32_t size = 0) : data(data), size(size) {}
+    const char * Data() const { return data; }
+    uint32_t Size() const { return size; }
+private:
+    const char *data;
+    uint32_t size;
+};
+
+// A record that owns a copy of its bytes, for keeping past the next read
+class BamRecord : public BamRecordFields<BamRecord> {
+public:
+    const char * Data() const { return data.data(); }
+    uint32_t Size() const { return data.size(); }
+    operator BamRecordView() const { return BamRecordView(data.data(), data.size()); }
+    void Assign(const BamRecordView &view) { data.assign(view.Data(), view.Data() + view.Size()); }
+    std::vector<char> data;
+};
+
+
+#endif //_BAMRECORD_H
@@ -2,16 +2,125 @@
 // Created by Kevin Gori on 24/02/2017.
 //
 
+#include <algorithm>
 #include <unordered_set>
 #include <iomanip>
 #include <future>
 #include <iostream>
+#include <cstring>
+#include <array>
+#include <cctype>
 #include "BamfileIO.h"
 
 
-ClosingBamReader::ClosingBamReader(const boost::filesystem::path filename) {
-    if (!this->Open(filename.string())) {
+template <typename T>
+static void pack(std::string &data, T value) {
+    data.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+// Smallest UCSC bin containing [begin, end), as calculated by BamTools
+static uint16_t calculate_minimum_bin(int begin, int end) {
+    --end;
+    if ((begin >> 14) == (end >> 14)) return uint16_t(4681 + (begin >> 14));
+    if ((begin >> 17) == (end >> 17)) return uint16_t(585 + (begin >> 17));
+    if ((begin >> 20) == (end >> 20)) return uint16_t(73 + (begin >> 20));
+    if ((begin >> 23) == (end >> 23)) return uint16_t(9 + (begin >> 23));
+    if ((begin >> 26) == (end >> 26)) return uint16_t(1 + (begin >> 26));
+    return 0;
+}
+
+static uint8_t encode_base(char base) {
+    static const std::array<uint8_t, 256> codes = [] {
+        std::array<uint8_t, 256> table;
+        table.fill(15);
+        for (uint8_t i = 0; i < 16; ++i) {
+            table[uint8_t(SEQUENCE_BASES[i])] = i;
+            table[uint8_t(std::tolower(SEQUENCE_BASES[i]))] = i;
+        }
+        return table;
+    }();
+    return codes[uint8_t(base)];
+}
+
+// Starts data with the block_size prefix and the fixed-length fields of alignment
+static void encode_core(const BamTools::BamAlignment &alignment, uint32_t block_size, uint32_t name_length,
+                        uint32_t cigar_length, uint32_t length, std::string &data) {
+    const uint32_t bin = calculate_minimum_bin(alignment.Position, alignment.GetEndPosition());
+    data.clear();
+    data.reserve(block_size + 4);
+    pack<uint32_t>(data, block_size);
+    pack<int32_t>(data, alignment.RefID);
+    pack<int32_t>(data, alignment.Position);
+    pack<uint32_t>(data, bin << 16 | uint32_t(alignment.MapQuality & 0xff) << 8 | name_length);
+    pack<uint32_t>(data, alignment.AlignmentFlag << 16 | cigar_length);
+    pack<int32_t>(data, length);
+    pack<int32_t>(data, alignment.MateRefID);
+    pack<int32_t>(data, alignment.MatePosition);
+    pack<int32_t>(data, alignment.InsertSize);
+}
+
+// Serialises alignment, including its block_size prefix, the same way as
+// BamTools::BamWriter does for fully populated alignments
+static void encode_alignment(const BamTools::BamAlignment &alignment, std::string &data) {
+    const uint32_t name_length = alignment.Name.size() + 1;
+    const uint32_t cigar_length = alignment.CigarData.size();
+    const uint32_t length = alignment.QueryBases == "*" ? 0 : alignment.QueryBases.size();
+    if (name_length > 255 || cigar_length > 0xffff) {
+        throw BamFormatException("Read " + alignment.Name + " can't be stored in BAM format");
+    }
+    const uint32_t block_size = 32 + name_length + 4 * cigar_length + (length + 1) / 2 + length +
+                                alignment.TagData.size();
+    encode_core(alignment, block_size, name_length, cigar_length, length, data);
+    data.append(alignment.Name.c_str(), name_length);
+
+    for (const auto &op : alignment.CigarData) {
+        const char *code = std::strchr(CIGAR_OPERATIONS, op.Type);
+        if (op.Type == '\0' || code == nullptr) {
+            throw BamFormatException("Read " + alignment.Name + " has an invalid CIGAR operation");
+        }
+        pack<uint32_t>(data, op.Length << 4 | uint32_t(code - CIGAR_OPERATIONS));
+    }
+
+    for (uint32_t i = 0; i < length; i += 2) {
+        uint8_t packed = encode_base(alignment.QueryBases[i]) << 4;
+        if (i + 1 < length) packed |= encode_base(alignment.QueryBases[i + 1]);
+        data.push_back(char(packed));
+    }
+
+    const std::string &qualities = alignment.Qualities;
+    if (qualities.empty() || qualities == "*" || uint8_t(qualities[0]) == 0xff) {
+        data.append(length, char(0xff));
+    }
+    else {
+        for (uint32_t i = 0; i < length; ++i) {
+            data.push_back(i < qualities.size() ? char(qualities[i] - 33) : char(0xff));
+        }
+    }
+
+    data += alignment.TagData;
+}
+
+// Serialises an alignment read by GetNextAlignmentCore as BamTools::BamWriter
+// does one with only its core decoded: the fixed-length fields come from the
+// alignment, and the name, CIGAR, sequence, qualities and tags from the
+// record it was read from, kept in AlignedBases
+static void encode_core_alignment(const BamTools::BamAlignment &alignment, std::string &data) {
+    const std::string &raw = alignment.AlignedBases;
+    if (!is_valid_record(raw.data(), raw.size())) {
+        throw BamFormatException("Core-only alignment doesn't hold the record it was read from");
+    }
+    encode_core(alignment, raw.size(), uint8_t(raw[8]), unpack<uint16_t>(raw.data() + 12),
+                unpack<uint32_t>(raw.data() + 16), data);
+    data.append(raw, 32, std::string::npos);
+}
+
+ClosingBamReader::ClosingBamReader(const boost::filesystem::path filename, const ReaderOptions &options)
+        : filename(filename.string()) {
+    stream = std::make_unique<BgzfReader>(this->filename, options.threads, options.use_mmap,
+                                          size_t(std::max(options.read_ahead, 0)));
+    if (!stream->IsOpen() || !ReadHeader()) {
         std::cerr << "Couldn't open " << boost::filesystem::system_complete(filename) << " for reading" << std::endl;
+        stream->Close();
     }
 }
 
@@ -19,26 +128,233 @@ ClosingBamReader::~ClosingBamReader() {
     if (this->IsOpen()) this->Close();
 }
 
+bool ClosingBamReader::IsOpen() const {
+    return stream && stream->IsOpen();
+}
 
-ClosingBamWriter::ClosingBamWriter(const boost::filesystem::path filename, const BamTools::SamHeader &header, const BamTools::RefVector &refs) {
-        if (!this->Open(filename.string(), header, refs)) {
-            std::cerr << "Couldn't open " << filename << " for writing" << std::endl;
-        }
-        this->filename = filename.string();
+void ClosingBamReader::Close() {
+    stream->Close();
+}
+
+bool ClosingBamReader::GetNextAlignment(BamTools::BamAlignment &alignment) {
+    BamRecordView record;
+    if (!GetNextRecordView(record)) return false;
+    record.ToAlignment(alignment);
+    alignment.Filename = filename;
+    return true;
+}
+
+bool ClosingBamReader::GetNextAlignmentCore(BamTools::BamAlignment &alignment) {
+    BamRecordView record;
+    if (!GetNextRecordView(record)) return false;
+    record.ToAlignmentCore(alignment);
+    // Kept in place of BamTools' private SupportData, for SaveAlignment to write back
+    alignment.AlignedBases.assign(record.Data(), record.Size());
+    alignment.Filename = filename;
+    return true;
+}
+
+bool ClosingBamReader::GetNextRecord(BamRecord &record) {
+    BamRecordView view;
+    if (!GetNextRecordView(view)) return false;
+    record.Assign(view);
+    return true;
+}
+
+// Hands over the rest of the file block by block, without decoding records:
+// first whatever is left of the block being read, uncompressed in block.data,
+// then each remaining block compressed as stored. For ClosingBamWriter::SaveRawBlock.
+bool ClosingBamReader::GetNextRawBlock(BgzfBlock &block) {
+    if (!IsOpen()) return false;
+    size_t buffered = stream->Buffered();
+    if (buffered > 0) {
+        block.compressed.clear();
+        block.mapped = nullptr;
+        block.data.resize(buffered);
+        stream->Read(block.data.data(), buffered);
+        return true;
+    }
+    return stream->ReadCompressedBlock(block);
+}
+
+// Virtual offset of the next record
+uint64_t ClosingBamReader::Tell() const {
+    return stream->Tell();
+}
+
+const BamTools::SamHeader & ClosingBamReader::GetConstSamHeader() const {
+    return header;
+}
+
+const BamTools::RefVector & ClosingBamReader::GetReferenceData() const {
+    return references;
+}
+
+const std::string & ClosingBamReader::GetFilename() const {
+    return filename;
+}
+
+bool ClosingBamReader::ReadHeader() {
+    char magic[4];
+    char field[4];
+    if (stream->Read(magic, 4) != 4 || std::memcmp(magic, "BAM\1", 4) != 0) return false;
+
+    if (stream->Read(field, 4) != 4) return false;
+    int32_t text_length = unpack<int32_t>(field);
+    if (text_length < 0) return false;
+    std::string text(text_length, '\0');
+    if (stream->Read(&text[0], text_length) != size_t(text_length)) return false;
+    text.resize(std::strlen(text.c_str())); // some writers pad the text with NULs
+    header = BamTools::SamHeader(text);
+
+    if (stream->Read(field, 4) != 4) return false;
+    int32_t n_references = unpack<int32_t>(field);
+    references.clear();
+    for (int32_t i = 0; i < n_references; ++i) {
+        if (stream->Read(field, 4) != 4) return false;
+        int32_t name_length = unpack<int32_t>(field);
+        if (name_length <= 0) return false;
+        std::string name(name_length, '\0');
+        if (stream->Read(&name[0], name_length) != size_t(name_length)) return false;
+        name.resize(name_length - 1);
+        if (stream->Read(field, 4) != 4) return false;
+        references.emplace_back(name, unpack<int32_t>(field));
     }
+    return true;
+}
+
+// Reads the next serialised record (without its block_size prefix). The view is
+// valid until the reader is next used.
+bool ClosingBamReader::GetNextRecordView(BamRecordView &record) {
+    if (!IsOpen()) return false;
+    char field[4];
+    size_t n = stream->Read(field, 4);
+    if (n == 0) return false;
+    uint32_t size = n == 4 ? unpack<uint32_t>(field) : 0;
+    if (size < 32) {
+        throw BamFormatException("Truncated BAM record in " + filename);
+    }
+    const char *data = stream->ReadSpan(size, scratch);
+    if (!data) {
+        throw BamFormatException("Truncated BAM record in " + filename);
+    }
+    if (!is_valid_record(data, size)) {
+        throw BamFormatException("Malformed BAM record in " + filename);
+    }
+    record = BamRecordView(data, size);
+    return true;
+}
+
+
+ClosingBamWriter::ClosingBamWriter(const boost::filesystem::path filename, const BamTools::SamHeader &header,
+                                   const BamTools::RefVector &refs, const WriterOptions &options)
+        : filename(filename.string()) {
+    stream = std::make_unique<BgzfWriter>(this->filename, options.compression_level, options.threads);
+    if (!stream->IsOpen()) {
+        std::cerr << "Couldn't open " << filename << " for writing" << std::endl;
+        return;
+    }
+    WriteHeader(header, refs);
+    if (options.build_index) {
+        index = std::make_unique<BaiIndexBuilder>(refs.size());
+    }
+}
 
 ClosingBamWriter::~ClosingBamWriter() {
     if (this->IsOpen()) {
-        this->Close();
-        ClosingBamReader reader(this->filename);
-        reader.CreateIndex();
+        try {
+            this->Close();
+        }
+        catch (const std::exception &e) {
+            std::cerr << "Error closing " << filename << ": " << e.what() << std::endl;
+        }
+    }
+}
+
+bool ClosingBamWriter::IsOpen() const {
+    return stream->IsOpen();
+}
+
+void ClosingBamWriter::Close() {
+    stream->Close();
+    if (index) {
+        if (!index->IsValid()) {
+            std::cerr << "Not indexing " << filename << " as it isn't sorted by coordinate" << std::endl;
+        }
+        else if (!index->Write(filename + ".bai", stream->GetBlockOffsets())) {
+            std::cerr << "Couldn't write index for " << filename << std::endl;
+        }
+        index.reset();
+    }
+}
+
+bool ClosingBamWriter::SaveAlignment(const BamTools::BamAlignment &alignment) {
+    if (!IsOpen()) return false;
+    if (alignment.Name.empty() && !alignment.AlignedBases.empty()) {
+        encode_core_alignment(alignment, record);
+    }
+    else if (alignment.Name.empty() || (alignment.Length > 0 && alignment.QueryBases.empty())) {
+        // BAM names are never empty, so this is a core decoded without its record
+        std::cerr << "Can't write an alignment without its name and sequence to " << filename << std::endl;
+        return false;
+    }
+    else {
+        encode_alignment(alignment, record);
+    }
+    uint64_t begin = stream->Tell();
+    stream->Write(record.data(), record.size());
+    if (index) {
+        index->AddRecord(alignment.RefID, alignment.Position, alignment.GetEndPosition(),
+                         unpack<uint16_t>(record.data() + 14), alignment.IsMapped(), begin, stream->Tell());
     }
+    return true;
+}
+
+bool ClosingBamWriter::SaveRecord(const BamRecordView &record) {
+    if (!IsOpen()) return false;
+    uint32_t block_size = record.Size();
+    uint64_t begin = stream->Tell();
+    stream->Write(reinterpret_cast<const char *>(&block_size), 4);
+    stream->Write(record.Data(), block_size);
+    if (index) {
+        index->AddRecord(record.RefID(), record.Position(), record.GetEndPosition(), record.Bin(),
+                         record.IsMapped(), begin, stream->Tell());
+    }
+    return true;
+}
+
+bool ClosingBamWriter::SaveRawBlock(const BgzfBlock &block) {
+    if (!IsOpen()) return false;
+    index.reset();
+    if (block.CompressedSize() > 0) {
+        stream->WriteCompressedBlock(block);
+    }
+    else {
+        stream->Write(block.data.data(), block.data.size());
+    }
+    return true;
 }
 
 const std::string & ClosingBamWriter::GetFilename() {
     return this->filename;
 }
 
+// The header gets its own block(s), so the first record starts on a block boundary
+void ClosingBamWriter::WriteHeader(const BamTools::SamHeader &header, const BamTools::RefVector &refs) {
+    std::string text = header.ToString();
+    std::string data("BAM\1", 4);
+    pack<int32_t>(data, text.size());
+    data += text;
+    pack<int32_t>(data, refs.size());
+    for (const auto &ref : refs) {
+        pack<int32_t>(data, ref.RefName.size() + 1);
+        data.append(ref.RefName.c_str(), ref.RefName.size() + 1);
+        pack<int32_t>(data, ref.RefLength);
+    }
+    stream->Write(data.data(), data.size());
+    stream->Flush();
+}
+
 
 ClosingBamMultiReader::ClosingBamMultiReader(const std::vector<boost::filesystem::path> filenames) {
     assert(SetExplicitMergeOrder(MergeOrder::MergeByCoordinate));
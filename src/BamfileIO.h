@@ -5,26 +5,99 @@
 #include <api/BamReader.h>
 #include <api/BamMultiReader.h>
 #include <api/BamWriter.h>
+#include "BaiIndex.h"
+#include "BamRecord.h"
+#include "Bgzf.h"
 
 
 #ifndef _BAMFILEIO_H
 #define _BAMFILEIO_H
 
-class ClosingBamReader : public BamTools::BamReader {
+struct BamFormatException : public std::runtime_error {
+    BamFormatException(const std::string &what) : std::runtime_error(what) {}
+};
+
+// Input settings. threads is the number of workers inflating blocks ahead of
+// the reader; use_mmap maps the file rather than reading it with stdio, so
+// several readers of one file share its pages in the page cache. Without
+// use_mmap, read_ahead > 0 keeps that many asynchronous block-sized reads in
+// flight, for storage where latency rather than bandwidth limits throughput.
+struct ReaderOptions {
+    explicit ReaderOptions(int threads = 0, bool use_mmap = false, int read_ahead = 0)
+            : threads(threads), use_mmap(use_mmap), read_ahead(read_ahead) {}
+    int threads;
+    bool use_mmap;
+    int read_ahead;
+};
+
+// Reads BAM records through a BgzfReader, so that with options.threads > 0
+// upcoming blocks are inflated in parallel ahead of GetNextAlignment.
+// GetNextRecordView returns records undecoded, as views into the decompressed
+// block where possible, for filtering on core fields and passing to
+// ClosingBamWriter::SaveRecord; GetNextRecord copies them out instead.
+// GetNextAlignmentCore decodes only the core fields and CIGAR, leaving the
+// name, sequence, qualities and tags empty, and keeps the record's bytes in
+// AlignedBases, as BamTools keeps them in SupportData, to be written back.
+class ClosingBamReader {
 public:
-    ClosingBamReader(const boost::filesystem::path filename);
+    ClosingBamReader(const boost::filesystem::path filename, const ReaderOptions &options = ReaderOptions());
     ~ClosingBamReader();
+    bool IsOpen() const;
+    void Close();
+    bool GetNextAlignment(BamTools::BamAlignment &alignment);
+    bool GetNextAlignmentCore(BamTools::BamAlignment &alignment);
+    bool GetNextRecord(BamRecord &record);
+    bool GetNextRecordView(BamRecordView &record);
+    bool GetNextRawBlock(BgzfBlock &block);
+    uint64_t Tell() const;
+    const BamTools::SamHeader & GetConstSamHeader() const;
+    const BamTools::RefVector & GetReferenceData() const;
+    const std::string & GetFilename() const;
+private:
+    bool ReadHeader();
+    std::string filename;
+    std::unique_ptr<BgzfReader> stream;
+    BamTools::SamHeader header;
+    BamTools::RefVector references;
+    std::vector<char> scratch; // holds records that span two blocks
+};
+
+// Output settings, chosen separately for pipeline temporaries and final outputs.
+// compression_level is a zlib level: -1 for the default, 0 for uncompressed blocks.
+// build_index writes a .bai next to the output as it is written.
+struct WriterOptions {
+    explicit WriterOptions(int compression_level = -1, int threads = 0, bool build_index = true)
+            : compression_level(compression_level), threads(threads), build_index(build_index) {}
+    int compression_level;
+    int threads;
+    bool build_index;
 };
 
-class ClosingBamWriter : public BamTools::BamWriter {
+// Writes BAM records through a BgzfWriter, so that with options.threads > 0
+// blocks are deflated on a worker pool while the caller serialises records.
+// The BAI index is built from the offsets of saved records and written on Close,
+// unless raw blocks were saved, as the records in those are never seen.
+// SaveAlignment encodes from the decoded fields, or for alignments read by
+// GetNextAlignmentCore, from their core fields and the rest of their record.
+class ClosingBamWriter {
 public:
     ClosingBamWriter(const boost::filesystem::path filename,
                      const BamTools::SamHeader &header,
-                     const BamTools::RefVector &refs);
+                     const BamTools::RefVector &refs,
+                     const WriterOptions &options = WriterOptions());
     ~ClosingBamWriter();
+    bool IsOpen() const;
+    void Close();
+    bool SaveAlignment(const BamTools::BamAlignment &alignment);
+    bool SaveRecord(const BamRecordView &record);
+    bool SaveRawBlock(const BgzfBlock &block);
     const std::string & GetFilename();
 private:
+    void WriteHeader(const BamTools::SamHeader &header, const BamTools::RefVector &refs);
     std::string filename;
+    std::unique_ptr<BgzfWriter> stream;
+    std::unique_ptr<BaiIndexBuilder> index;
+    std::string record;
 };
 
 class ClosingBamMultiReader : public BamTools::BamMultiReader {
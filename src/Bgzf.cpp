@@ -0,0 +1,570 @@
+//
+// BGZF block input and output used by ClosingBamReader and ClosingBamWriter.
+//
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Bgzf.h"
+#include "DeflateCodec.h"
+
+static const unsigned char BGZF_EOF_MARKER[28] = {
+        31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 66, 67, 2, 0, 27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+// Bytes of a mapped file the kernel is asked to fetch ahead of the reader at a time
+static const size_t MMAP_READAHEAD = 8 << 20;
+
+static uint32_t unpack_uint32(const char *data) {
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+    return uint32_t(bytes[0]) | uint32_t(bytes[1]) << 8 | uint32_t(bytes[2]) << 16 | uint32_t(bytes[3]) << 24;
+}
+
+static void pack_uint32(char *data, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        data[i] = char((value >> (8 * i)) & 0xff);
+    }
+}
+
+// Codecs are kept for the life of the thread, one per compression level, so
+// their state is set up once rather than for every block
+static DeflateCodec & thread_codec(int level) {
+    thread_local std::unique_ptr<DeflateCodec> codecs[11];
+    auto &codec = codecs[level + 1];
+    if (!codec) codec = std::make_unique<DeflateCodec>(level);
+    return *codec;
+}
+
+void inflate_block(BgzfBlock &block) {
+    const char *compressed = block.CompressedData();
+    const size_t compressed_size = block.CompressedSize();
+    const char *footer = compressed + compressed_size - BGZF_BLOCK_FOOTER_LENGTH;
+    const uint32_t crc = unpack_uint32(footer);
+    const uint32_t length = unpack_uint32(footer + 4);
+    if (length > BGZF_MAX_BLOCK_SIZE) {
+        throw BgzfException("BGZF block at offset " + std::to_string(block.offset) + " is too large");
+    }
+
+    block.data.resize(length);
+    if (length == 0) return; // EOF marker, or an empty block
+
+    DeflateCodec &codec = thread_codec(-1);
+    if (!codec.Decompress(compressed + BGZF_BLOCK_HEADER_LENGTH,
+                          compressed_size - BGZF_BLOCK_HEADER_LENGTH - BGZF_BLOCK_FOOTER_LENGTH,
+                          block.data.data(), length)) {
+        throw BgzfException("Couldn't inflate BGZF block at offset " + std::to_string(block.offset));
+    }
+    if (DeflateCodec::Crc32(block.data.data(), length) != crc) {
+        throw BgzfException("CRC mismatch in BGZF block at offset " + std::to_string(block.offset));
+    }
+}
+
+void deflate_block(BgzfBlock &block, int level) {
+    static const unsigned char header[BGZF_BLOCK_HEADER_LENGTH] = {
+            31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 66, 67, 2, 0, 0, 0
+    };
+    const size_t length = block.data.size();
+    block.compressed.resize(BGZF_MAX_BLOCK_SIZE);
+    std::memcpy(block.compressed.data(), header, BGZF_BLOCK_HEADER_LENGTH);
+
+    const size_t compressed_size = thread_codec(level).Compress(
+            block.data.data(), length, block.compressed.data() + BGZF_BLOCK_HEADER_LENGTH,
+            BGZF_MAX_BLOCK_SIZE - BGZF_BLOCK_HEADER_LENGTH - BGZF_BLOCK_FOOTER_LENGTH);
+    if (compressed_size == 0) {
+        throw BgzfException("Couldn't deflate BGZF block");
+    }
+
+    const size_t block_size = BGZF_BLOCK_HEADER_LENGTH + compressed_size + BGZF_BLOCK_FOOTER_LENGTH;
+    block.compressed[16] = char((block_size - 1) & 0xff);
+    block.compressed[17] = char((block_size - 1) >> 8);
+    char *footer = block.compressed.data() + block_size - BGZF_BLOCK_FOOTER_LENGTH;
+    pack_uint32(footer, DeflateCodec::Crc32(block.data.data(), length));
+    pack_uint32(footer + 4, length);
+    block.compressed.resize(block_size);
+}
+
+
+BgzfReader::BgzfReader(const std::string &filename, int threads, bool use_mmap, size_t read_ahead) {
+    if (!use_mmap || !OpenMapping(filename)) {
+        if (read_ahead > 0) {
+            ahead = std::make_unique<ReadAhead>(filename, read_ahead);
+            if (!ahead->IsOpen()) ahead.reset();
+        }
+        if (!ahead) {
+            file = std::fopen(filename.c_str(), "rb");
+            if (!file) return;
+        }
+    }
+    if (threads > 0) {
+        capacity = 4 * size_t(threads);
+        for (int i = 0; i < threads; ++i) {
+            workers.emplace_back(&BgzfReader::Worker, this);
+        }
+    }
+}
+
+BgzfReader::~BgzfReader() {
+    Close();
+}
+
+bool BgzfReader::IsOpen() const {
+    return file != nullptr || map != nullptr || ahead != nullptr;
+}
+
+void BgzfReader::Close() {
+    {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        stopping = true;
+    }
+    has_space.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+    pending.clear();
+    if (file) {
+        std::fclose(file);
+        file = nullptr;
+    }
+    if (map) {
+        munmap(const_cast<char *>(map), map_size);
+        map = nullptr;
+    }
+    ahead.reset();
+}
+
+size_t BgzfReader::Read(char *dest, size_t length) {
+    size_t copied = 0;
+    while (copied < length) {
+        if (current_pos == current.data.size()) {
+            if (!LoadNextBlock()) break;
+            continue;
+        }
+        size_t n = std::min(length - copied, current.data.size() - current_pos);
+        std::memcpy(dest + copied, current.data.data() + current_pos, n);
+        current_pos += n;
+        copied += n;
+    }
+    return copied;
+}
+
+// Reads length bytes and returns a pointer to them. When they lie within the
+// current block the pointer refers to the block itself and nothing is copied;
+// otherwise they are gathered into scratch. Either way the pointer is only
+// valid until the next read. Returns nullptr if fewer than length bytes remain.
+const char * BgzfReader::ReadSpan(size_t length, std::vector<char> &scratch) {
+    if (current_pos == current.data.size() && !LoadNextBlock()) {
+        return length == 0 ? current.data.data() : nullptr;
+    }
+    if (current.data.size() - current_pos >= length) {
+        const char *span = current.data.data() + current_pos;
+        current_pos += length;
+        return span;
+    }
+    scratch.resize(length);
+    if (Read(scratch.data(), length) != length) return nullptr;
+    return scratch.data();
+}
+
+// Inflated bytes left in the current block
+size_t BgzfReader::Buffered() const {
+    return current.data.size() - current_pos;
+}
+
+// Hands over the next block as stored, without inflating it, skipping empty
+// blocks such as the EOF marker. Anything still buffered from the current
+// block is discarded, so read it out first (see Buffered).
+bool BgzfReader::ReadCompressedBlock(BgzfBlock &block) {
+    current.data.clear();
+    current_pos = 0;
+    while (true) {
+        if (workers.empty()) {
+            if (!IsOpen() || !ReadBlock(block)) return false;
+        }
+        else {
+            // The pool has already inflated upcoming blocks; take them as they come
+            if (!LoadNextBlock()) return false;
+            std::swap(block, current);
+            current.data.clear();
+            current_pos = 0;
+        }
+        block.data.clear();
+        if (unpack_uint32(block.CompressedData() + block.CompressedSize() - 4) != 0) return true;
+    }
+}
+
+uint64_t BgzfReader::Tell() const {
+    if (current_pos == current.data.size()) {
+        return (current.offset + current.CompressedSize()) << 16;
+    }
+    return current.offset << 16 | current_pos;
+}
+
+bool BgzfReader::LoadNextBlock() {
+    if (!IsOpen()) return false;
+
+    if (workers.empty()) {
+        if (!ReadBlock(current)) return false;
+        inflate_block(current);
+        current_pos = 0;
+        return true;
+    }
+
+    std::shared_ptr<Job> job;
+    {
+        std::unique_lock<std::mutex> lock(state_mutex);
+        has_block.wait(lock, [this] {
+            return pending.empty() ? file_eof : pending.front()->ready;
+        });
+        if (pending.empty()) return false;
+        job = pending.front();
+        pending.pop_front();
+    }
+    has_space.notify_one();
+
+    if (job->error) std::rethrow_exception(job->error);
+    std::swap(current, job->block);
+    current_pos = 0;
+    return true;
+}
+
+// Maps the whole file read-only. Returns false if it can't be mapped (for
+// example an empty file or a pipe), in which case it's read with stdio instead.
+bool BgzfReader::OpenMapping(const std::string &filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void *addr = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps its own reference to the file
+    if (addr == MAP_FAILED) return false;
+    map = static_cast<const char *>(addr);
+    map_size = size_t(st.st_size);
+    madvise(addr, map_size, MADV_SEQUENTIAL);
+    return true;
+}
+
+// Reads the next compressed block from the file. Returns false at end of file.
+bool BgzfReader::ReadBlock(BgzfBlock &block) {
+    if (map) return MapBlock(block);
+
+    char header[BGZF_BLOCK_HEADER_LENGTH];
+    size_t n = ReadBytes(header, BGZF_BLOCK_HEADER_LENGTH);
+    if (n == 0) return false;
+
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(header);
+    if (n != BGZF_BLOCK_HEADER_LENGTH || bytes[0] != 31 || bytes[1] != 139 || bytes[2] != 8 ||
+        (bytes[3] & 4) == 0 || bytes[12] != 'B' || bytes[13] != 'C') {
+        throw BgzfException("Invalid BGZF block header at offset " + std::to_string(file_offset));
+    }
+    size_t block_size = (size_t(bytes[16]) | size_t(bytes[17]) << 8) + 1;
+    if (block_size < BGZF_BLOCK_HEADER_LENGTH + BGZF_BLOCK_FOOTER_LENGTH) {
+        throw BgzfException("Invalid BGZF block size at offset " + std::to_string(file_offset));
+    }
+
+    block.offset = file_offset;
+    block.mapped = nullptr;
+    block.compressed.resize(block_size);
+    std::memcpy(block.compressed.data(), header, BGZF_BLOCK_HEADER_LENGTH);
+    size_t remaining = block_size - BGZF_BLOCK_HEADER_LENGTH;
+    if (ReadBytes(block.compressed.data() + BGZF_BLOCK_HEADER_LENGTH, remaining) != remaining) {
+        throw BgzfException("Truncated BGZF block at offset " + std::to_string(file_offset));
+    }
+    file_offset += block_size;
+    return true;
+}
+
+size_t BgzfReader::ReadBytes(char *dest, size_t length) {
+    if (ahead) return ahead->Read(dest, length);
+    return std::fread(dest, 1, length, file);
+}
+
+// As ReadBlock, but points the block at its bytes in the mapping rather than
+// copying them out
+bool BgzfReader::MapBlock(BgzfBlock &block) {
+    if (file_offset == map_size) return false;
+
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(map + file_offset);
+    if (map_size - file_offset < BGZF_BLOCK_HEADER_LENGTH || bytes[0] != 31 || bytes[1] != 139 ||
+        bytes[2] != 8 || (bytes[3] & 4) == 0 || bytes[12] != 'B' || bytes[13] != 'C') {
+        throw BgzfException("Invalid BGZF block header at offset " + std::to_string(file_offset));
+    }
+    size_t block_size = (size_t(bytes[16]) | size_t(bytes[17]) << 8) + 1;
+    if (block_size < BGZF_BLOCK_HEADER_LENGTH + BGZF_BLOCK_FOOTER_LENGTH) {
+        throw BgzfException("Invalid BGZF block size at offset " + std::to_string(file_offset));
+    }
+    if (block_size > map_size - file_offset) {
+        throw BgzfException("Truncated BGZF block at offset " + std::to_string(file_offset));
+    }
+
+    // Keep the kernel reading at least half a window ahead of the blocks handed out
+    if (file_offset + MMAP_READAHEAD / 2 >= advised_until && advised_until < map_size) {
+        size_t length = std::min(MMAP_READAHEAD, map_size - size_t(advised_until));
+        madvise(const_cast<char *>(map) + advised_until, length, MADV_WILLNEED);
+        advised_until += length;
+    }
+
+    block.offset = file_offset;
+    block.compressed.clear();
+    block.mapped = map + file_offset;
+    block.mapped_size = block_size;
+    file_offset += block_size;
+    return true;
+}
+
+// Decode pool worker. Blocks are read from the file one at a time, and queued
+// in file order before being inflated, so the consumer can take them in sequence.
+void BgzfReader::Worker() {
+    while (true) {
+        auto job = std::make_shared<Job>();
+        {
+            std::lock_guard<std::mutex> io_lock(io_mutex);
+            {
+                std::unique_lock<std::mutex> lock(state_mutex);
+                has_space.wait(lock, [this] { return stopping || file_eof || pending.size() < capacity; });
+                if (stopping || file_eof) return;
+            }
+
+            bool have_block = false;
+            try {
+                have_block = ReadBlock(job->block);
+            }
+            catch (...) {
+                job->error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock(state_mutex);
+            if (!have_block) {
+                file_eof = true;
+                if (job->error) {
+                    job->ready = true;
+                    pending.push_back(job);
+                }
+                has_block.notify_all();
+                has_space.notify_all();
+                return;
+            }
+            pending.push_back(job);
+        }
+
+        try {
+            inflate_block(job->block);
+        }
+        catch (...) {
+            job->error = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            job->ready = true;
+        }
+        has_block.notify_all();
+    }
+}
+
+
+BgzfWriter::BgzfWriter(const std::string &filename, int level, int threads) : level(level) {
+    if (level < -1 || level > 9) {
+        throw BgzfException("Invalid compression level " + std::to_string(level));
+    }
+    file = std::fopen(filename.c_str(), "wb");
+    if (!file) return;
+    current.data.reserve(BGZF_DEFAULT_BLOCK_SIZE);
+    if (threads > 0) {
+        capacity = 4 * size_t(threads);
+        for (int i = 0; i < threads; ++i) {
+            workers.emplace_back(&BgzfWriter::Worker, this);
+        }
+    }
+}
+
+BgzfWriter::~BgzfWriter() {
+    try {
+        Close();
+    }
+    catch (const std::exception &e) {
+        std::fprintf(stderr, "%s\n", e.what());
+    }
+}
+
+bool BgzfWriter::IsOpen() const {
+    return file != nullptr;
+}
+
+// Flushes any buffered data, waits for outstanding blocks and appends the EOF marker
+void BgzfWriter::Close() {
+    if (!file) return;
+    std::exception_ptr close_error;
+    try {
+        Flush();
+    }
+    catch (...) {
+        close_error = std::current_exception();
+    }
+    {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        stopping = true;
+    }
+    has_work.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+    WriteReadyBlocks();
+    block_offsets.push_back(file_offset);
+
+    if (!close_error && !error) {
+        if (std::fwrite(BGZF_EOF_MARKER, 1, sizeof(BGZF_EOF_MARKER), file) != sizeof(BGZF_EOF_MARKER)) {
+            error = std::make_exception_ptr(BgzfException("Couldn't write BGZF EOF marker"));
+        }
+    }
+    if (std::fclose(file) != 0 && !error) {
+        error = std::make_exception_ptr(BgzfException("Couldn't close BGZF output"));
+    }
+    file = nullptr;
+    if (close_error) std::rethrow_exception(close_error);
+    CheckError();
+}
+
+void BgzfWriter::Write(const char *data, size_t length) {
+    while (length > 0) {
+        size_t n = std::min(length, BGZF_DEFAULT_BLOCK_SIZE - current.data.size());
+        current.data.insert(current.data.end(), data, data + n);
+        data += n;
+        length -= n;
+        if (current.data.size() == BGZF_DEFAULT_BLOCK_SIZE) Flush();
+    }
+}
+
+// Deferred virtual offset of the next byte: the block number rather than the
+// block's file offset is kept in the upper 48 bits, because with a pool the
+// compressed size of earlier blocks may not be known yet. GetBlockOffsets
+// translates block numbers to file offsets once the writer is closed.
+uint64_t BgzfWriter::Tell() const {
+    return n_blocks << 16 | current.data.size();
+}
+
+// File offset of each block written, followed by the offset of the end of the
+// data. Only complete after Close.
+const std::vector<uint64_t> & BgzfWriter::GetBlockOffsets() const {
+    return block_offsets;
+}
+
+// Appends a block that is already compressed, such as one from
+// BgzfReader::ReadCompressedBlock, after everything written so far
+void BgzfWriter::WriteCompressedBlock(const BgzfBlock &block) {
+    if (!file) return;
+    Flush();
+    CheckError();
+    ++n_blocks;
+
+    if (workers.empty()) {
+        WriteBlock(block);
+        return;
+    }
+
+    auto job = std::make_shared<Job>();
+    job->block.compressed.assign(block.CompressedData(), block.CompressedData() + block.CompressedSize());
+    job->ready = true;
+    {
+        std::unique_lock<std::mutex> lock(state_mutex);
+        has_space.wait(lock, [this] { return error || to_write.size() < capacity; });
+        to_write.push_back(job);
+    }
+    WriteReadyBlocks();
+}
+
+// Ends the current block, so the next byte written starts a new one
+void BgzfWriter::Flush() {
+    if (!file || current.data.empty()) return;
+    CheckError();
+    ++n_blocks;
+
+    if (workers.empty()) {
+        deflate_block(current, level);
+        WriteBlock(current);
+        current.data.clear();
+        return;
+    }
+
+    auto job = std::make_shared<Job>();
+    std::swap(job->block, current);
+    current.data.reserve(BGZF_DEFAULT_BLOCK_SIZE);
+    {
+        std::unique_lock<std::mutex> lock(state_mutex);
+        has_space.wait(lock, [this] { return error || to_write.size() < capacity; });
+        to_write.push_back(job);
+        to_compress.push_back(job);
+    }
+    has_work.notify_one();
+}
+
+void BgzfWriter::CheckError() {
+    std::lock_guard<std::mutex> lock(state_mutex);
+    if (error) std::rethrow_exception(error);
+}
+
+void BgzfWriter::WriteBlock(const BgzfBlock &block) {
+    block_offsets.push_back(file_offset);
+    const size_t size = block.CompressedSize();
+    if (std::fwrite(block.CompressedData(), 1, size, file) != size) {
+        throw BgzfException("Couldn't write BGZF block at offset " + std::to_string(file_offset));
+    }
+    file_offset += size;
+}
+
+// Writes compressed blocks from the front of the queue until one is found
+// that is still being worked on
+void BgzfWriter::WriteReadyBlocks() {
+    std::lock_guard<std::mutex> io_lock(io_mutex);
+    while (true) {
+        std::shared_ptr<Job> job;
+        bool failed;
+        {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            if (to_write.empty() || !to_write.front()->ready) break;
+            job = to_write.front();
+            to_write.pop_front();
+            failed = bool(error);
+        }
+        try {
+            if (!failed) WriteBlock(job->block);
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            error = std::current_exception();
+        }
+        has_space.notify_all();
+    }
+}
+
+void BgzfWriter::Worker() {
+    while (true) {
+        std::shared_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lock(state_mutex);
+            has_work.wait(lock, [this] { return stopping || !to_compress.empty(); });
+            if (to_compress.empty()) return;
+            job = to_compress.front();
+            to_compress.pop_front();
+        }
+
+        try {
+            deflate_block(job->block, level);
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            error = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            job->ready = true;
+        }
+        WriteReadyBlocks();
+    }
+}
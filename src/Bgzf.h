@@ -0,0 +1,149 @@
+//
+// BGZF block input and output used by ClosingBamReader and ClosingBamWriter.
+//
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ReadAhead.h"
+
+#ifndef _BGZF_H
+#define _BGZF_H
+
+const size_t BGZF_BLOCK_HEADER_LENGTH = 18;
+const size_t BGZF_BLOCK_FOOTER_LENGTH = 8;
+const size_t BGZF_MAX_BLOCK_SIZE = 65536;
+const size_t BGZF_DEFAULT_BLOCK_SIZE = 0xff00; // uncompressed bytes per output block
+
+struct BgzfException : public std::runtime_error {
+    BgzfException(const std::string &what) : std::runtime_error(what) {}
+};
+
+struct BgzfBlock {
+    uint64_t offset = 0;            // file offset of the compressed block
+    std::vector<char> compressed;   // complete compressed block, header and footer included
+    std::vector<char> data;         // inflated contents
+
+    // Set instead of compressed when the block is read in place from a memory-mapped file
+    const char *mapped = nullptr;
+    size_t mapped_size = 0;
+
+    const char * CompressedData() const { return mapped ? mapped : compressed.data(); }
+    size_t CompressedSize() const { return mapped ? mapped_size : compressed.size(); }
+};
+
+// Sequential reader over the blocks of a BGZF file. With threads > 0 a pool of
+// workers reads and inflates upcoming blocks ahead of the consumer, and blocks
+// are handed back in file order. With use_mmap the file is mapped read-only and
+// blocks are inflated straight from the mapping, with the kernel asked to read
+// ahead of the current position; if the file can't be mapped it is read as usual.
+// Otherwise, with read_ahead > 0, up to that many block-sized reads are kept in
+// flight ahead of the blocks being inflated (see ReadAhead).
+class BgzfReader {
+public:
+    BgzfReader(const std::string &filename, int threads = 0, bool use_mmap = false, size_t read_ahead = 0);
+    ~BgzfReader();
+    bool IsOpen() const;
+    void Close();
+    size_t Read(char *dest, size_t length);
+    const char * ReadSpan(size_t length, std::vector<char> &scratch);
+    size_t Buffered() const;
+    bool ReadCompressedBlock(BgzfBlock &block);
+    uint64_t Tell() const;
+
+private:
+    struct Job {
+        BgzfBlock block;
+        std::exception_ptr error;
+        bool ready = false;
+    };
+
+    bool LoadNextBlock();
+    bool ReadBlock(BgzfBlock &block);
+    bool MapBlock(BgzfBlock &block);
+    bool OpenMapping(const std::string &filename);
+    size_t ReadBytes(char *dest, size_t length);
+    void Worker();
+
+    std::FILE *file = nullptr;
+    std::unique_ptr<ReadAhead> ahead;
+    uint64_t file_offset = 0;
+    bool file_eof = false;
+
+    // Memory-mapped input
+    const char *map = nullptr;
+    size_t map_size = 0;
+    uint64_t advised_until = 0;
+
+    BgzfBlock current;
+    size_t current_pos = 0;
+
+    // Decode pool state
+    std::vector<std::thread> workers;
+    std::deque<std::shared_ptr<Job>> pending;
+    size_t capacity = 0;
+    bool stopping = false;
+    std::mutex io_mutex;
+    std::mutex state_mutex;
+    std::condition_variable has_space;
+    std::condition_variable has_block;
+};
+
+// Buffers output into blocks of BGZF_DEFAULT_BLOCK_SIZE bytes, deflated at the
+// given zlib compression level (0 stores blocks uncompressed). With threads > 0
+// full blocks are deflated on a pool of workers and written out in submission
+// order, so the file is byte-identical to single-threaded output.
+class BgzfWriter {
+public:
+    BgzfWriter(const std::string &filename, int level = -1, int threads = 0);
+    ~BgzfWriter();
+    bool IsOpen() const;
+    void Close();
+    void Write(const char *data, size_t length);
+    void WriteCompressedBlock(const BgzfBlock &block);
+    void Flush();
+    uint64_t Tell() const;
+    const std::vector<uint64_t> & GetBlockOffsets() const;
+
+private:
+    struct Job {
+        BgzfBlock block;
+        bool ready = false;
+    };
+
+    void WriteReadyBlocks();
+    void WriteBlock(const BgzfBlock &block);
+    void Worker();
+    void CheckError();
+
+    std::FILE *file = nullptr;
+    uint64_t file_offset = 0;
+    int level;
+    BgzfBlock current;
+    uint64_t n_blocks = 0;
+    std::vector<uint64_t> block_offsets;
+
+    // Encode pool state
+    std::vector<std::thread> workers;
+    std::deque<std::shared_ptr<Job>> to_compress;
+    std::deque<std::shared_ptr<Job>> to_write;
+    size_t capacity = 0;
+    bool stopping = false;
+    std::exception_ptr error;
+    std::mutex io_mutex;
+    std::mutex state_mutex;
+    std::condition_variable has_work;
+    std::condition_variable has_space;
+};
+
+void inflate_block(BgzfBlock &block);
+void deflate_block(BgzfBlock &block, int level);
+
+#endif //_BGZF_H
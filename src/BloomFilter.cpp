@@ -0,0 +1,50 @@
+//
+// Blocked Bloom filter over 64-bit name fingerprints.
+//
+
+#include "BloomFilter.h"
+
+// Odd multipliers taking the high half of a fingerprint to a bit of each word
+static const uint32_t BLOOM_SALT[8] = {
+        0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+        0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+// Bit of each word that fingerprint sets, in mask form
+static inline uint64_t bloom_bit(uint64_t fingerprint, size_t word) {
+    return uint64_t(1) << ((uint32_t(fingerprint >> 32) * BLOOM_SALT[word]) >> 26);
+}
+
+BloomFilter::BloomFilter() {
+    Reset(0);
+}
+
+void BloomFilter::Reset(size_t n_keys, size_t bits_per_key) {
+    n_blocks = (n_keys * bits_per_key + 511) / 512;
+    if (n_blocks == 0) n_blocks = 1;
+    // One spare block's worth of words, so blocks can start on a cache line
+    words.assign((n_blocks + 1) * BLOCK_WORDS, 0);
+    uintptr_t base = reinterpret_cast<uintptr_t>(words.data());
+    first = (((base + 63) & ~uintptr_t(63)) - base) / sizeof(uint64_t);
+}
+
+void BloomFilter::Insert(uint64_t fingerprint) {
+    uint64_t *block = &words[Block(fingerprint)];
+    for (size_t i = 0; i < BLOCK_WORDS; ++i) {
+        block[i] |= bloom_bit(fingerprint, i);
+    }
+}
+
+bool BloomFilter::MayContain(uint64_t fingerprint) const {
+    const uint64_t *block = &words[Block(fingerprint)];
+    bool present = true;
+    for (size_t i = 0; i < BLOCK_WORDS; ++i) {
+        present &= (block[i] & bloom_bit(fingerprint, i)) != 0;
+    }
+    return present;
+}
+
+// Index of the first word of fingerprint's block
+size_t BloomFilter::Block(uint64_t fingerprint) const {
+    return first + size_t((uint64_t(uint32_t(fingerprint)) * n_blocks) >> 32) * BLOCK_WORDS;
+}
@@ -0,0 +1,37 @@
+//
+// Blocked Bloom filter over 64-bit name fingerprints.
+//
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#ifndef _BLOOMFILTER_H
+#define _BLOOMFILTER_H
+
+// Bloom filter split into 64-byte blocks, one cache line each. A fingerprint
+// picks a block from its low 32 bits and sets one bit in each of the block's
+// eight words from its high 32 bits, so a test touches a single cache line.
+// At 10 bits a key about 1% of absent keys test positive.
+//
+// Callers put one in front of a larger set that won't fit in cache, to skip
+// the set's probe for keys that are certainly absent.
+class BloomFilter {
+public:
+    BloomFilter();
+
+    // Empties the filter and sizes it for n_keys
+    void Reset(size_t n_keys, size_t bits_per_key = 10);
+    void Insert(uint64_t fingerprint);
+    bool MayContain(uint64_t fingerprint) const;
+
+private:
+    static const size_t BLOCK_WORDS = 8;
+
+    size_t Block(uint64_t fingerprint) const;
+
+    std::vector<uint64_t> words;
+    size_t n_blocks = 0;
+    size_t first = 0; // words before the first cache-line boundary
+};
+
+#endif //_BLOOMFILTER_H
@@ -0,0 +1,102 @@
+//
+// Raw deflate compression of BGZF block payloads, with a compile-time choice of implementation.
+//
+
+#include <cstring>
+#include "DeflateCodec.h"
+
+// level is a zlib compression level, -1 for the default. libdeflate accepts
+// the same scale (and beyond, up to 12), so levels mean the same with either.
+DeflateCodec::DeflateCodec(int level) : level(level) {
+    if (level < -1 || level > 9) {
+        throw DeflateCodecException("Invalid compression level " + std::to_string(level));
+    }
+}
+
+DeflateCodec::~DeflateCodec() {
+#ifdef USE_LIBDEFLATE
+    if (compressor) libdeflate_free_compressor(compressor);
+    if (decompressor) libdeflate_free_decompressor(decompressor);
+#else
+    if (deflater_ready) deflateEnd(&deflater);
+    if (inflater_ready) inflateEnd(&inflater);
+#endif
+}
+
+int DeflateCodec::Level() const {
+    return level;
+}
+
+const char * DeflateCodec::Name() {
+#ifdef USE_LIBDEFLATE
+    return "libdeflate";
+#else
+    return "zlib";
+#endif
+}
+
+// Compresses length bytes of src into dest. Returns the compressed size, or 0
+// if it wouldn't fit in capacity bytes.
+size_t DeflateCodec::Compress(const char *src, size_t length, char *dest, size_t capacity) {
+#ifdef USE_LIBDEFLATE
+    if (!compressor) {
+        compressor = libdeflate_alloc_compressor(level < 0 ? 6 : level);
+        if (!compressor) throw DeflateCodecException("Couldn't initialise libdeflate compressor");
+    }
+    return libdeflate_deflate_compress(compressor, src, length, dest, capacity);
+#else
+    if (!deflater_ready) {
+        std::memset(&deflater, 0, sizeof(deflater));
+        if (deflateInit2(&deflater, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw DeflateCodecException("Couldn't initialise zlib deflate");
+        }
+        deflater_ready = true;
+    }
+    else {
+        deflateReset(&deflater);
+    }
+    deflater.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(src));
+    deflater.avail_in = uInt(length);
+    deflater.next_out = reinterpret_cast<Bytef *>(dest);
+    deflater.avail_out = uInt(capacity);
+    if (deflate(&deflater, Z_FINISH) != Z_STREAM_END) return 0;
+    return deflater.total_out;
+#endif
+}
+
+// Decompresses src into dest, which must be exactly length bytes. Returns
+// false if src is corrupt or doesn't inflate to that length.
+bool DeflateCodec::Decompress(const char *src, size_t src_length, char *dest, size_t length) {
+#ifdef USE_LIBDEFLATE
+    if (!decompressor) {
+        decompressor = libdeflate_alloc_decompressor();
+        if (!decompressor) throw DeflateCodecException("Couldn't initialise libdeflate decompressor");
+    }
+    // With no actual size requested, libdeflate only succeeds on an exact fit
+    return libdeflate_deflate_decompress(decompressor, src, src_length, dest, length, nullptr) == LIBDEFLATE_SUCCESS;
+#else
+    if (!inflater_ready) {
+        std::memset(&inflater, 0, sizeof(inflater));
+        if (inflateInit2(&inflater, -15) != Z_OK) {
+            throw DeflateCodecException("Couldn't initialise zlib inflate");
+        }
+        inflater_ready = true;
+    }
+    else {
+        inflateReset(&inflater);
+    }
+    inflater.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(src));
+    inflater.avail_in = uInt(src_length);
+    inflater.next_out = reinterpret_cast<Bytef *>(dest);
+    inflater.avail_out = uInt(length);
+    return inflate(&inflater, Z_FINISH) == Z_STREAM_END && inflater.total_out == length;
+#endif
+}
+
+uint32_t DeflateCodec::Crc32(const char *data, size_t length) {
+#ifdef USE_LIBDEFLATE
+    return libdeflate_crc32(0, data, length);
+#else
+    return uint32_t(crc32(0, reinterpret_cast<const Bytef *>(data), uInt(length)));
+#endif
+}
@@ -0,0 +1,55 @@
+//
+// Raw deflate compression of BGZF block payloads, with a compile-time choice of implementation.
+//
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#ifdef USE_LIBDEFLATE
+#include <libdeflate.h>
+#else
+#include <zlib.h>
+#endif
+
+#ifndef _DEFLATECODEC_H
+#define _DEFLATECODEC_H
+
+struct DeflateCodecException : public std::runtime_error {
+    DeflateCodecException(const std::string &what) : std::runtime_error(what) {}
+};
+
+// Compresses and decompresses raw deflate streams (no zlib or gzip wrapper),
+// and computes the CRC32 stored in BGZF block footers. Built on libdeflate,
+// which is several times faster on whole blocks, when compiled with
+// USE_LIBDEFLATE, and on zlib otherwise.
+//
+// A codec keeps its compressor and decompressor state between blocks, as
+// setting them up costs more than a block takes to process. It isn't
+// thread-safe: BgzfReader and BgzfWriter keep one per thread and level.
+class DeflateCodec {
+public:
+    DeflateCodec(int level = -1);
+    ~DeflateCodec();
+    DeflateCodec(const DeflateCodec &) = delete;
+    DeflateCodec & operator=(const DeflateCodec &) = delete;
+
+    int Level() const;
+    size_t Compress(const char *src, size_t length, char *dest, size_t capacity);
+    bool Decompress(const char *src, size_t src_length, char *dest, size_t length);
+    static uint32_t Crc32(const char *data, size_t length);
+    static const char * Name();
+
+private:
+    int level;
+#ifdef USE_LIBDEFLATE
+    struct libdeflate_compressor *compressor = nullptr;
+    struct libdeflate_decompressor *decompressor = nullptr;
+#else
+    z_stream deflater;
+    z_stream inflater;
+    bool deflater_ready = false;
+    bool inflater_ready = false;
+#endif
+};
+
+#endif //_DEFLATECODEC_H
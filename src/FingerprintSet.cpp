@@ -0,0 +1,212 @@
+//
+// Compact sets of read names, held as 64-bit fingerprints.
+//
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include "FingerprintSet.h"
+
+static const size_t FINGERPRINT_SET_MIN_SLOTS = 16;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// MurmurHash3 finaliser: every input bit affects every output bit
+static inline uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+// One lane of MurmurHash3 x64, taking the name 8 bytes at a time
+uint64_t name_fingerprint(const char *name, size_t length) {
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ length;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t k;
+        std::memcpy(&k, name + i, 8);
+        h ^= rotl64(k * c1, 31) * c2;
+        h = rotl64(h, 27) * 5 + 0x52dce729;
+    }
+    if (i < length) {
+        uint64_t k = 0;
+        std::memcpy(&k, name + i, length - i);
+        h ^= rotl64(k * c1, 31) * c2;
+    }
+    h = fmix64(h);
+    // 0 marks empty slots in FingerprintSet
+    return h == 0 ? 1 : h;
+}
+
+FingerprintSet::FingerprintSet() : slots(FINGERPRINT_SET_MIN_SLOTS, 0), mask(FINGERPRINT_SET_MIN_SLOTS - 1) {}
+
+// Fingerprints are already well mixed, so the low bits pick the home slot.
+// 0 is reserved for empty slots and stands in for 1.
+void FingerprintSet::Insert(uint64_t fingerprint) {
+    if (fingerprint == 0) fingerprint = 1;
+    if ((size + 1) * 4 > slots.size() * 3) Grow();
+    size_t i = fingerprint & mask;
+    while (slots[i] != 0) {
+        if (slots[i] == fingerprint) return;
+        i = (i + 1) & mask;
+    }
+    slots[i] = fingerprint;
+    ++size;
+}
+
+bool FingerprintSet::Contains(uint64_t fingerprint) const {
+    return slots[Find(fingerprint)] != 0;
+}
+
+// Removes fingerprint, returning whether it was present
+bool FingerprintSet::Erase(uint64_t fingerprint) {
+    size_t i = Find(fingerprint);
+    if (slots[i] == 0) return false;
+
+    // Backward-shift deletion: pull back any later entry of the run that
+    // would no longer be reachable from its home slot across the gap
+    size_t gap = i;
+    for (size_t j = (i + 1) & mask; slots[j] != 0; j = (j + 1) & mask) {
+        size_t home = slots[j] & mask;
+        if (((j - home) & mask) >= ((j - gap) & mask)) {
+            slots[gap] = slots[j];
+            gap = j;
+        }
+    }
+    slots[gap] = 0;
+    --size;
+    return true;
+}
+
+// Keeps the slots, as a set cleared between batches is refilled to about the same size
+void FingerprintSet::Clear() {
+    std::fill(slots.begin(), slots.end(), 0);
+    size = 0;
+}
+
+size_t FingerprintSet::Size() const {
+    return size;
+}
+
+bool FingerprintSet::Empty() const {
+    return size == 0;
+}
+
+// Slot holding fingerprint, or the empty slot that ends its probe run
+size_t FingerprintSet::Find(uint64_t fingerprint) const {
+    if (fingerprint == 0) fingerprint = 1;
+    size_t i = fingerprint & mask;
+    while (slots[i] != 0 && slots[i] != fingerprint) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+void FingerprintSet::Grow() {
+    std::vector<uint64_t> old(slots.size() * 2, 0);
+    old.swap(slots);
+    mask = slots.size() - 1;
+    for (auto fingerprint : old) {
+        if (fingerprint == 0) continue;
+        size_t i = fingerprint & mask;
+        while (slots[i] != 0) {
+            i = (i + 1) & mask;
+        }
+        slots[i] = fingerprint;
+    }
+}
+
+ExactNameSet::ExactNameSet() : names(Hash{&arena}, Equal{&arena}) {}
+
+// Packed names hash on their words, and others on their fingerprint
+static uint64_t packed_hash(const PackedName &key) {
+    return fmix64(key.hi * 0x87c37b91114253d5ULL ^ key.lo);
+}
+
+bool ExactNameSet::MakeLookup(const char *name, size_t length, uint64_t fingerprint, bool add,
+                              Lookup &lookup) const {
+    lookup.name = name;
+    lookup.length = length;
+    switch (codec.Pack(name, length, lookup.key, add)) {
+        case NameForm::Packed:
+            lookup.hash = packed_hash(lookup.key);
+            return true;
+        case NameForm::Raw:
+            lookup.key.hi = RAW;
+            lookup.hash = fingerprint;
+            return true;
+        default:
+            return false;
+    }
+}
+
+void ExactNameSet::Insert(const char *name, size_t length, uint64_t fingerprint) {
+    Lookup lookup;
+    MakeLookup(name, length, fingerprint, true, lookup);
+    if (lookup.key.hi != RAW) {
+        names.Insert(lookup, [&lookup]() { return lookup.key; });
+        return;
+    }
+    if (length > 0xffff) {
+        throw std::length_error("Read name of " + std::to_string(length) + " bytes is too long");
+    }
+    names.Insert(lookup, [&]() {
+        PackedName key;
+        key.hi = RAW;
+        key.lo = uint64_t(arena.size()) << 16 | length;
+        arena.insert(arena.end(), name, name + length);
+        return key;
+    });
+}
+
+bool ExactNameSet::Contains(const char *name, size_t length, uint64_t fingerprint) const {
+    Lookup lookup;
+    return MakeLookup(name, length, fingerprint, false, lookup) && names.Contains(lookup);
+}
+
+bool ExactNameSet::Erase(const char *name, size_t length, uint64_t fingerprint) {
+    Lookup lookup;
+    return MakeLookup(name, length, fingerprint, false, lookup) && names.Erase(lookup);
+}
+
+void ExactNameSet::Clear() {
+    arena.clear();
+    codec.Clear();
+    names.Clear();
+}
+
+size_t ExactNameSet::Size() const {
+    return names.Size();
+}
+
+bool ExactNameSet::Empty() const {
+    return names.Empty();
+}
+
+size_t ExactNameSet::ArenaBytes() const {
+    return arena.size();
+}
+
+uint64_t ExactNameSet::Hash::operator()(const PackedName &key) const {
+    if (key.hi != RAW) return packed_hash(key);
+    return name_fingerprint(arena->data() + (key.lo >> 16), key.lo & 0xffff);
+}
+
+bool ExactNameSet::Equal::operator()(const PackedName &key, const Lookup &lookup) const {
+    if (lookup.key.hi != RAW) return ((key.hi ^ lookup.key.hi) | (key.lo ^ lookup.key.lo)) == 0;
+    return key.hi == RAW && (key.lo & 0xffff) == lookup.length
+           && std::memcmp(arena->data() + (key.lo >> 16), lookup.name, lookup.length) == 0;
+}
+
+bool ExactNameSet::Equal::operator()(const PackedName &a, const PackedName &b) const {
+    if (a.hi != RAW || b.hi != RAW) return ((a.hi ^ b.hi) | (a.lo ^ b.lo)) == 0;
+    return (a.lo & 0xffff) == (b.lo & 0xffff)
+           && std::memcmp(arena->data() + (a.lo >> 16), arena->data() + (b.lo >> 16), a.lo & 0xffff) == 0;
+}
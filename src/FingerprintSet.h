@@ -0,0 +1,127 @@
+//
+// Compact sets of read names, held as 64-bit fingerprints.
+//
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "FlatHashSet.h"
+#include "NameCodec.h"
+
+#ifndef _FINGERPRINTSET_H
+#define _FINGERPRINTSET_H
+
+// 64-bit hash of a read name. Two different names in a set of n share a
+// fingerprint with probability about n^2 / 2^65, so a few in a million for
+// tens of millions of names. Never 0.
+uint64_t name_fingerprint(const char *name, size_t length);
+
+// Partition of a read name among n_partitions, from its fingerprint. It's
+// taken from the high bits, while FingerprintSet indexes on the low bits, so
+// the names of a partition still spread evenly over the set they're loaded into.
+inline size_t name_partition(uint64_t fingerprint, size_t n_partitions) {
+    return size_t(((fingerprint >> 32) * n_partitions) >> 32);
+}
+
+// Set of fingerprints in one flat open-addressing table, with linear probing
+// and at most 3/4 of the slots in use: about 11 bytes a name, where a
+// std::unordered_set<std::string> takes 80-100. Erase shifts later entries of
+// a probe run back, rather than leaving tombstones, as joins erase on every hit.
+class FingerprintSet {
+public:
+    FingerprintSet();
+    void Insert(uint64_t fingerprint);
+    bool Contains(uint64_t fingerprint) const;
+    bool Erase(uint64_t fingerprint);
+    void Clear();
+    size_t Size() const;
+    bool Empty() const;
+
+    // Calls f with each fingerprint, in no particular order
+    template <typename F>
+    void ForEach(F f) const {
+        for (auto fingerprint : slots) {
+            if (fingerprint != 0) f(fingerprint);
+        }
+    }
+
+private:
+    size_t Find(uint64_t fingerprint) const;
+    void Grow();
+
+    std::vector<uint64_t> slots; // 0 marks an empty slot
+    size_t mask = 0;
+    size_t size = 0;
+};
+
+// Set of whole read names, for when a fingerprint collision can't be risked.
+// Illumina-style names are held as PackedNames, 16 bytes each, compared a
+// word at a time. Any others are packed back to back in one arena, and the
+// table holds their offset and length instead. Adding a name allocates
+// nothing once the arena and table have grown to fit a batch; Clear keeps
+// both for the next. Erased names stay in the arena until then.
+//
+// Lookups take the name's fingerprint, which callers partitioning by name
+// will have already, for names that don't pack.
+class ExactNameSet {
+public:
+    ExactNameSet();
+    ExactNameSet(const ExactNameSet &) = delete;
+    ExactNameSet & operator=(const ExactNameSet &) = delete;
+
+    void Insert(const char *name, size_t length, uint64_t fingerprint);
+    bool Contains(const char *name, size_t length, uint64_t fingerprint) const;
+    bool Erase(const char *name, size_t length, uint64_t fingerprint);
+    void Clear();
+    size_t Size() const;
+    bool Empty() const;
+    size_t ArenaBytes() const;
+
+    // Calls f(name, length) for each name, in no particular order
+    template <typename F>
+    void ForEach(F f) const {
+        std::string unpacked;
+        names.ForEach([&](const PackedName &key) {
+            if (key.hi == RAW) {
+                f(arena.data() + (key.lo >> 16), size_t(key.lo & 0xffff));
+            }
+            else {
+                codec.Unpack(key, unpacked);
+                f(unpacked.data(), unpacked.size());
+            }
+        });
+    }
+
+private:
+    // hi of a name kept in the arena, whose lo is then offset << 16 | length.
+    // No packed name has it, as its prefix id would be out of range.
+    static const uint64_t RAW = ~uint64_t(0);
+
+    struct Lookup {
+        PackedName key; // hi is RAW for names that don't pack
+        const char *name;
+        size_t length;
+        uint64_t hash;
+    };
+
+    struct Hash {
+        const std::vector<char> *arena;
+        uint64_t operator()(const PackedName &key) const;
+        uint64_t operator()(const Lookup &lookup) const { return lookup.hash; }
+    };
+
+    struct Equal {
+        const std::vector<char> *arena;
+        bool operator()(const PackedName &key, const Lookup &lookup) const;
+        bool operator()(const PackedName &a, const PackedName &b) const;
+    };
+
+    // Sets up lookup for name. Returns false if name is certainly absent.
+    bool MakeLookup(const char *name, size_t length, uint64_t fingerprint, bool add, Lookup &lookup) const;
+
+    std::vector<char> arena;
+    mutable NameCodec codec;
+    FlatHashSet<PackedName, Hash, Equal> names;
+};
+
+#endif //_FINGERPRINTSET_H
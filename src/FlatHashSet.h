@@ -0,0 +1,221 @@
+//
+// Open-addressing hash set with one control byte per slot, probed 16 slots at a time.
+//
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifndef _FLATHASHSET_H
+#define _FLATHASHSET_H
+
+// 16 consecutive control bytes, compared against a value all at once
+class FlatHashGroup {
+public:
+    static const size_t WIDTH = 16;
+
+#ifdef __SSE2__
+    explicit FlatHashGroup(const int8_t *ctrl) : bytes(_mm_loadu_si128(reinterpret_cast<const __m128i *>(ctrl))) {}
+
+    // Bit i is set where byte i equals value
+    uint32_t Match(int8_t value) const {
+        return uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(value))));
+    }
+
+private:
+    __m128i bytes;
+#else
+    explicit FlatHashGroup(const int8_t *ctrl) : ctrl(ctrl) {}
+
+    uint32_t Match(int8_t value) const {
+        uint32_t bits = 0;
+        for (size_t i = 0; i < WIDTH; ++i) {
+            bits |= uint32_t(ctrl[i] == value) << i;
+        }
+        return bits;
+    }
+
+private:
+    const int8_t *ctrl;
+#endif
+};
+
+// Set of Keys stored inline in a flat array, alongside an array of control
+// bytes that are either EMPTY or 7 bits of the key's hash. Slots are
+// assigned by linear probing from the key's home slot, and a lookup compares
+// the control bytes of 16 slots at a time (with SSE2, where available), only
+// comparing keys whose hash bits match, up to the first empty slot.
+//
+// Erase shifts later entries of the probe run back over the gap, so there are
+// no tombstones and lookups don't slow down as entries are erased.
+//
+// Hash must be well mixed: its low bits pick the home slot, and 7 bits derived
+// from the whole value go in the control byte. Lookups may use any type K for
+// which both Hash()(K) and Equal()(Key, K) are defined, so keys stored by
+// reference (say, offsets into an arena) can be looked up without a Key.
+template <typename Key, typename Hash, typename Equal>
+class FlatHashSet {
+public:
+    FlatHashSet(const Hash &hash = Hash(), const Equal &equal = Equal()) : hash(hash), equal(equal) {
+        Allocate(MIN_SLOTS);
+    }
+
+    // Adds key, returning false if an equal key was already present
+    bool Insert(const Key &key) {
+        return Insert(key, [&key]() { return key; });
+    }
+
+    // Adds the key returned by make() unless there's one equal to lookup, so
+    // keys that refer to storage elsewhere are only built when they're new
+    template <typename K, typename Make>
+    bool Insert(const K &lookup, Make make) {
+        uint64_t h = hash(lookup);
+        size_t i;
+        if (Find(lookup, h, i)) return false;
+        if ((size + 1) * 4 > slots.size() * 3) {
+            Grow();
+            Find(lookup, h, i);
+        }
+        slots[i] = make();
+        SetCtrl(i, Tag(h));
+        ++size;
+        return true;
+    }
+
+    template <typename K>
+    bool Contains(const K &key) const {
+        size_t i;
+        return Find(key, hash(key), i);
+    }
+
+    // Removes the key equal to key, returning whether there was one
+    template <typename K>
+    bool Erase(const K &key) {
+        return Erase(key, [](const Key &) {});
+    }
+
+    // As Erase(key), first passing the stored key to removed
+    template <typename K, typename F>
+    bool Erase(const K &key, F removed) {
+        size_t i;
+        if (!Find(key, hash(key), i)) return false;
+        removed(slots[i]);
+        EraseSlot(i);
+        return true;
+    }
+
+    // Calls f with each key, in no particular order
+    template <typename F>
+    void ForEach(F f) const {
+        for (size_t i = 0; i < slots.size(); ++i) {
+            if (ctrl[i] != EMPTY) f(slots[i]);
+        }
+    }
+
+    // Empties the set, keeping its capacity for the next batch of keys
+    void Clear() {
+        std::fill(ctrl.begin(), ctrl.end(), EMPTY);
+        size = 0;
+    }
+
+    size_t Size() const { return size; }
+    bool Empty() const { return size == 0; }
+
+private:
+    static const int8_t EMPTY = -128;
+    static const size_t MIN_SLOTS = FlatHashGroup::WIDTH;
+
+    // Top 7 bits of h, after a multiply that folds in all the others, so tags
+    // still differ between keys whose high hash bits don't (those that went
+    // to the same partition of a join, for instance)
+    static int8_t Tag(uint64_t h) {
+        return int8_t((h * 0x9e3779b97f4a7c15ULL) >> 57);
+    }
+
+    // Finds the slot holding key and returns true, or returns false with slot
+    // set to the empty slot that ends key's probe run
+    template <typename K>
+    bool Find(const K &key, uint64_t h, size_t &slot) const {
+        size_t i = h & mask;
+        int8_t tag = Tag(h);
+        while (true) {
+            FlatHashGroup group(&ctrl[i]);
+            uint32_t empty = group.Match(EMPTY);
+            // Only slots before the first empty one belong to the run
+            uint32_t matches = group.Match(tag) & (empty ? (empty & -empty) - 1 : 0xffffu);
+            while (matches) {
+                size_t j = (i + __builtin_ctz(matches)) & mask;
+                if (equal(slots[j], key)) {
+                    slot = j;
+                    return true;
+                }
+                matches &= matches - 1;
+            }
+            if (empty) {
+                slot = (i + __builtin_ctz(empty)) & mask;
+                return false;
+            }
+            i = (i + FlatHashGroup::WIDTH) & mask;
+        }
+    }
+
+    void EraseSlot(size_t i) {
+        size_t gap = i;
+        for (size_t j = (i + 1) & mask; ctrl[j] != EMPTY; j = (j + 1) & mask) {
+            size_t home = hash(slots[j]) & mask;
+            if (((j - home) & mask) >= ((j - gap) & mask)) {
+                slots[gap] = std::move(slots[j]);
+                SetCtrl(gap, ctrl[j]);
+                gap = j;
+            }
+        }
+        SetCtrl(gap, EMPTY);
+        --size;
+    }
+
+    // The first WIDTH - 1 control bytes are mirrored after the last, so a
+    // group can be loaded from any slot without wrapping
+    void SetCtrl(size_t i, int8_t value) {
+        ctrl[i] = value;
+        if (i < FlatHashGroup::WIDTH - 1) ctrl[slots.size() + i] = value;
+    }
+
+    void Allocate(size_t n_slots) {
+        slots.assign(n_slots, Key());
+        ctrl.assign(n_slots + FlatHashGroup::WIDTH - 1, EMPTY);
+        mask = n_slots - 1;
+    }
+
+    void Grow() {
+        std::vector<Key> old_slots;
+        std::vector<int8_t> old_ctrl;
+        old_slots.swap(slots);
+        old_ctrl.swap(ctrl);
+        Allocate(old_slots.size() * 2);
+        for (size_t j = 0; j < old_slots.size(); ++j) {
+            if (old_ctrl[j] == EMPTY) continue;
+            size_t i = hash(old_slots[j]) & mask;
+            while (ctrl[i] != EMPTY) {
+                i = (i + 1) & mask;
+            }
+            slots[i] = std::move(old_slots[j]);
+            SetCtrl(i, old_ctrl[j]);
+        }
+    }
+
+    std::vector<Key> slots;
+    std::vector<int8_t> ctrl;
+    size_t mask = 0;
+    size_t size = 0;
+    Hash hash;
+    Equal equal;
+};
+
+template <typename Key, typename Hash, typename Equal>
+const int8_t FlatHashSet<Key, Hash, Equal>::EMPTY;
+
+#endif //_FLATHASHSET_H
@@ -0,0 +1,246 @@
+//
+// Pairing and coverage filtering of half-mapped reads in a single pass in coordinate order.
+//
+
+#include <algorithm>
+#include <numeric>
+#include "HalfMappedStream.h"
+
+static int compare_names(const BamRecordView &a, const BamRecordView &b) {
+    int order = std::memcmp(a.Name(), b.Name(), std::min(a.NameLength(), b.NameLength()));
+    if (order != 0) return order;
+    return a.NameLength() < b.NameLength() ? -1 : a.NameLength() > b.NameLength();
+}
+
+HalfMappedStream::HalfMappedStream(ClosingBamWriter &mapped_out, ClosingBamWriter &unmapped_out, int mincoverage)
+        : mapped_out(mapped_out), unmapped_out(unmapped_out), visitor(mincoverage), pileup(true) {
+    pileup.AddVisitor(&visitor);
+}
+
+void HalfMappedStream::Add(const BamRecordView &read) {
+    if (read.RefID() != read.MateRefID() || read.Position() != read.MatePosition()) {
+        throw StreamOrderException(std::string("Read ") + read.Name() + " isn't placed with its mate");
+    }
+    MoveTo(read);
+    std::vector<BamRecord> &window = read.IsMapped() ? window_mapped : window_unmapped;
+    window.emplace_back();
+    window.back().Assign(read);
+}
+
+void HalfMappedStream::AddPair(const BamRecordView &mapped, const BamRecordView &unmapped) {
+    MoveTo(mapped);
+    window_mapped.emplace_back();
+    window_mapped.back().Assign(mapped);
+    window_unmapped.emplace_back();
+    window_unmapped.back().Assign(unmapped);
+}
+
+// Pairs the reads at the current position, if read is at the next
+void HalfMappedStream::MoveTo(const BamRecordView &read) {
+    if (read.RefID() != window_ref || read.Position() != window_pos) {
+        if (read.RefID() < window_ref || (read.RefID() == window_ref && read.Position() < window_pos)) {
+            throw StreamOrderException(std::string("Read ") + read.Name() + " is out of coordinate order");
+        }
+        PairWindow();
+        window_ref = read.RefID();
+        window_pos = read.Position();
+    }
+}
+
+void HalfMappedStream::Finish() {
+    PairWindow();
+    pileup.Flush();
+    visitor.Finalise();
+    finished = true;
+    WriteDecided();
+}
+
+// Pairs each mapped read at the current position with the first unmapped read
+// of its name, as long as no earlier mapped read took that one, and piles it up
+void HalfMappedStream::PairWindow() {
+    if (!window_mapped.empty() && !window_unmapped.empty()) {
+        by_name.resize(window_unmapped.size());
+        std::iota(by_name.begin(), by_name.end(), 0);
+        std::stable_sort(by_name.begin(), by_name.end(), [this](size_t a, size_t b) {
+            return compare_names(window_unmapped[a], window_unmapped[b]) < 0;
+        });
+
+        std::vector<std::pair<size_t, size_t>> mates;
+        std::vector<bool> taken(window_unmapped.size(), false);
+        for (size_t i = 0; i < window_mapped.size(); ++i) {
+            const BamRecord &mapped = window_mapped[i];
+            auto first = std::lower_bound(by_name.begin(), by_name.end(), mapped, [this](size_t j, const BamRecord &m) {
+                return compare_names(window_unmapped[j], m) < 0;
+            });
+            if (first == by_name.end() || taken[*first] || compare_names(window_unmapped[*first], mapped) != 0) {
+                continue;
+            }
+            taken[*first] = true;
+            mates.emplace_back(i, *first);
+        }
+
+        for (const auto &mate : mates) {
+            window_mapped[mate.first].ToAlignmentCore(alignment);
+            pileup.AddAlignment(alignment);
+            pending.push_back(Pair{std::move(window_mapped[mate.first]), std::move(window_unmapped[mate.second]),
+                                   mate.second, n_groups, false});
+        }
+        if (!mates.empty()) {
+            piled_ref = window_ref;
+            piled_pos = window_pos;
+            n_groups++;
+        }
+    }
+    window_mapped.clear();
+    window_unmapped.clear();
+    WriteDecided();
+}
+
+// Tests read against the coverage region the pairs before it left off at, as
+// write_overlaps would with all the regions to hand. A region still being
+// extended only grows at its end, and those yet to start lie beyond the last
+// position piled up, so the verdict can often be given before they're settled.
+HalfMappedStream::Verdict HalfMappedStream::Decide(const BamRecordView &read) {
+    std::vector<Region> &regions = visitor.regions;
+    // Only mapped reads are decided, so their reference and end aren't negative
+    unsigned long read_ref = static_cast<unsigned long>(read.RefID());
+    unsigned long read_end = static_cast<unsigned long>(read.GetEndPosition());
+    Region open(0, 0, 0);
+    if (region_index < regions.size() || (region_index == regions.size() && visitor.InProgress(open))) {
+        bool settled = region_index < regions.size();
+        Region &region = settled ? regions[region_index] : open;
+        if (region.overlaps(read)) {
+            return Verdict::Keep;
+        }
+        if (settled || region.ref_id != read_ref) {
+            if (region.fullyLeftOf(read)) region_index++;
+            return Verdict::Drop;
+        }
+        // Whatever its end, the region neither overlaps nor lies left of a read ending before it starts
+        return read_end <= region.start ? Verdict::Drop : Verdict::Wait;
+    }
+    if (finished || piled_ref > read.RefID() || read.GetEndPosition() <= piled_pos) {
+        return Verdict::Drop;
+    }
+    return Verdict::Wait;
+}
+
+// Decides what pairs it can, and writes those found at positions whose pairs
+// are all decided: the mapped halves in input order, and the unmapped likewise
+void HalfMappedStream::WriteDecided() {
+    while (n_decided < pending.size()) {
+        Verdict verdict = Decide(pending[n_decided].mapped);
+        if (verdict == Verdict::Wait) break;
+        pending[n_decided++].keep = verdict == Verdict::Keep;
+    }
+
+    std::vector<const Pair *> kept;
+    while (n_decided > 0) {
+        uint64_t group = pending.front().group;
+        size_t end = 0;
+        while (end < pending.size() && pending[end].group == group) ++end;
+        if (end > n_decided) break;
+
+        kept.clear();
+        for (size_t i = 0; i < end; ++i) {
+            if (pending[i].keep) kept.push_back(&pending[i]);
+        }
+        for (const Pair *pair : kept) {
+            mapped_out.SaveRecord(pair->mapped);
+        }
+        std::sort(kept.begin(), kept.end(), [](const Pair *a, const Pair *b) { return a->order < b->order; });
+        for (const Pair *pair : kept) {
+            unmapped_out.SaveRecord(pair->unmapped);
+        }
+        n_mapped_written += kept.size();
+        n_unmapped_written += kept.size();
+
+        pending.erase(pending.begin(), pending.begin() + end);
+        n_decided -= end;
+    }
+}
+
+HalfMappedSorter::HalfMappedSorter(const boost::filesystem::path &tmpdir, const BamTools::SamHeader &header,
+                                   const BamTools::RefVector &references, size_t memory_limit,
+                                   const WriterOptions &tmp_options)
+        : tmpdir(tmpdir), header(header), references(references),
+          memory_limit(memory_limit > 0 ? memory_limit : DEFAULT_SORT_BYTES), tmp_options(tmp_options) {}
+
+HalfMappedSorter::~HalfMappedSorter() {
+    for (const auto &run : runs) {
+        boost::filesystem::remove(run);
+    }
+}
+
+void HalfMappedSorter::Add(const BamRecordView &mapped, const BamRecordView &unmapped) {
+    reads.emplace_back();
+    reads.back().Assign(mapped);
+    reads.emplace_back();
+    reads.back().Assign(unmapped);
+    bytes += mapped.Size() + unmapped.Size() + 2 * sizeof(BamRecord) + sizeof(size_t);
+    if (bytes > memory_limit) Spill();
+}
+
+// Pairs read from the sorted runs, merged by position and then run
+struct SortedRun {
+    explicit SortedRun(const boost::filesystem::path &path) : reader(path) {}
+    bool Next() { return reader.GetNextRecord(mapped) && reader.GetNextRecord(unmapped); }
+    ClosingBamReader reader;
+    BamRecord mapped;
+    BamRecord unmapped;
+};
+
+void HalfMappedSorter::Finish(HalfMappedStream &stream) {
+    if (runs.empty()) {
+        Sort();
+        for (size_t pair : order) {
+            stream.AddPair(reads[2 * pair], reads[2 * pair + 1]);
+        }
+    }
+    else {
+        if (!reads.empty()) Spill();
+        std::vector<std::unique_ptr<SortedRun>> merging;
+        for (const auto &run : runs) {
+            merging.push_back(std::make_unique<SortedRun>(run));
+            if (!merging.back()->Next()) merging.pop_back();
+        }
+        while (!merging.empty()) {
+            size_t first = 0;
+            for (size_t i = 1; i < merging.size(); ++i) {
+                const BamRecord &a = merging[i]->mapped;
+                const BamRecord &b = merging[first]->mapped;
+                if (a.RefID() < b.RefID() || (a.RefID() == b.RefID() && a.Position() < b.Position())) first = i;
+            }
+            stream.AddPair(merging[first]->mapped, merging[first]->unmapped);
+            if (!merging[first]->Next()) merging.erase(merging.begin() + first);
+        }
+    }
+    reads.clear();
+    order.clear();
+    bytes = 0;
+}
+
+void HalfMappedSorter::Sort() {
+    order.resize(reads.size() / 2);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+        const BamRecord &x = reads[2 * a];
+        const BamRecord &y = reads[2 * b];
+        return x.RefID() < y.RefID() || (x.RefID() == y.RefID() && x.Position() < y.Position());
+    });
+}
+
+void HalfMappedSorter::Spill() {
+    Sort();
+    // Unique names keep sorters sharing a temporary directory apart
+    runs.push_back(tmpdir / boost::filesystem::unique_path("tmp_half_mapped_%%%%_%%%%.bam"));
+    {
+        ClosingBamWriter writer(runs.back(), header, references, tmp_options);
+        for (size_t pair : order) {
+            writer.SaveRecord(reads[2 * pair]);
+            writer.SaveRecord(reads[2 * pair + 1]);
+        }
+    }
+    reads.clear();
+    bytes = 0;
+}
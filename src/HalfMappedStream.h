@@ -0,0 +1,122 @@
+//
+// Pairing and coverage filtering of half-mapped reads in a single pass in coordinate order.
+//
+#include <deque>
+#include <stdexcept>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <utils/bamtools_pileup_engine.h>
+#include "BamfileIO.h"
+#include "PileupUtils.h"
+
+#ifndef _HALFMAPPEDSTREAM_H
+#define _HALFMAPPEDSTREAM_H
+
+const size_t DEFAULT_SORT_BYTES = size_t(256) << 20;
+
+struct StreamOrderException : public std::runtime_error {
+    StreamOrderException(const std::string &what) : std::runtime_error(what) {}
+};
+
+// Pairs mapped reads whose mates are unmapped with those mates, and writes the
+// pairs in areas of high coverage, as the reads of a coordinate-sorted file
+// are added. By SAM convention an unmapped read with a mapped mate is placed
+// at its mate's position, so the reads at one position at a time are enough
+// to pair them up. The mapped halves are piled up as they're paired, and each
+// pair is written once the coverage regions it could overlap are settled.
+// The outputs are the same as pairing the reads through temporary files,
+// piling up all the mapped halves and then picking out the pairs overlapping
+// coverage regions.
+//
+// Add throws StreamOrderException for a read out of coordinate order, or not
+// placed with its mate, after which the outputs are of no use.
+class HalfMappedStream {
+public:
+    HalfMappedStream(ClosingBamWriter &mapped_out, ClosingBamWriter &unmapped_out, int mincoverage);
+
+    // Adds a read with one of its pair mapped and the other unmapped
+    void Add(const BamRecordView &read);
+    // Adds a pair already found, at the mapped read's position wherever the unmapped is placed
+    void AddPair(const BamRecordView &mapped, const BamRecordView &unmapped);
+    // Pairs and writes the reads still held, once all have been added
+    void Finish();
+
+    const std::vector<Region> & Regions() const { return visitor.regions; }
+    unsigned long MappedWritten() const { return n_mapped_written; }
+    unsigned long UnmappedWritten() const { return n_unmapped_written; }
+
+private:
+    enum class Verdict { Keep, Drop, Wait };
+
+    struct Pair {
+        BamRecord mapped;
+        BamRecord unmapped;
+        size_t order;   // input order of the unmapped half among its position's reads
+        uint64_t group; // position the pair was found at, counting from 0
+        bool keep;
+    };
+
+    void MoveTo(const BamRecordView &read);
+    void PairWindow();
+    Verdict Decide(const BamRecordView &read);
+    void WriteDecided();
+
+    ClosingBamWriter &mapped_out;
+    ClosingBamWriter &unmapped_out;
+    CoverageVisitor visitor;
+    BamTools::PileupEngine pileup;
+    BamTools::BamAlignment alignment;
+
+    // Reads at the current position
+    int32_t window_ref = -1;
+    int32_t window_pos = -1;
+    std::vector<BamRecord> window_mapped;
+    std::vector<BamRecord> window_unmapped;
+    std::vector<size_t> by_name;
+
+    // Pairs in input order, the first n_decided of them decided
+    std::deque<Pair> pending;
+    size_t n_decided = 0;
+    uint64_t n_groups = 0;
+    size_t region_index = 0;       // region the next pair is tested against
+    int32_t piled_ref = -1;        // position of the last read piled up
+    int32_t piled_pos = -1;
+    bool finished = false;
+
+    unsigned long n_mapped_written = 0;
+    unsigned long n_unmapped_written = 0;
+};
+
+// Holds half-mapped pairs found in any order, to add them to a HalfMappedStream
+// by the positions of their mapped reads, keeping the order they were found in
+// among pairs at the same position. Pairs beyond memory_limit bytes are
+// sorted and written to temporary files in tmpdir, and merged by Finish.
+// There can be hundreds of runs, so they're merged through plain readers,
+// without decode threads or read-ahead buffers of their own.
+class HalfMappedSorter {
+public:
+    HalfMappedSorter(const boost::filesystem::path &tmpdir, const BamTools::SamHeader &header,
+                     const BamTools::RefVector &references, size_t memory_limit = DEFAULT_SORT_BYTES,
+                     const WriterOptions &tmp_options = WriterOptions());
+    ~HalfMappedSorter();
+
+    void Add(const BamRecordView &mapped, const BamRecordView &unmapped);
+    void Finish(HalfMappedStream &stream);
+
+private:
+    void Sort();
+    void Spill();
+
+    boost::filesystem::path tmpdir;
+    BamTools::SamHeader header;
+    BamTools::RefVector references;
+    size_t memory_limit;
+    WriterOptions tmp_options;
+
+    std::vector<BamRecord> reads; // the mapped and unmapped read of each pair in turn
+    std::vector<size_t> order;    // pairs by position
+    size_t bytes = 0;
+    std::vector<boost::filesystem::path> runs;
+};
+
+#endif //_HALFMAPPEDSTREAM_H
@@ -0,0 +1,201 @@
+//
+// Pairing of reads with mates written close by, among the last few reads seen.
+//
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <numeric>
+#include "FingerprintSet.h"
+#include "MateWindow.h"
+
+MateWindow::MateWindow(ClosingBamWriter &paired_out, ClosingBamWriter &first_out, ClosingBamWriter &second_out,
+                       size_t size)
+        : paired_out(paired_out), first_out(first_out), second_out(second_out),
+          records(size > 0 ? size : 1), fingerprints(records.size(), 0), waiting(records.size(), false),
+          slots(Hash{&fingerprints}, Equal{&records}) {}
+
+bool MateWindow::Equal::operator()(uint32_t slot, const Lookup &lookup) const {
+    const BamRecord &record = (*records)[slot];
+    return record.IsFirstMate() == lookup.first_mate && record.NameLength() == lookup.length
+           && std::memcmp(record.Name(), lookup.name, lookup.length) == 0;
+}
+
+void MateWindow::Add(const BamRecordView &read) {
+    uint64_t fingerprint = name_fingerprint(read.Name(), read.NameLength());
+    uint32_t mate = 0;
+    Lookup other{read.Name(), read.NameLength(), fingerprint, !read.IsFirstMate()};
+    if (slots.Erase(other, [&mate](uint32_t slot) { mate = slot; })) {
+        waiting[mate] = false;
+        paired_out.SaveRecord(read.IsFirstMate() ? read : BamRecordView(records[mate]));
+        paired_out.SaveRecord(read.IsFirstMate() ? BamRecordView(records[mate]) : read);
+        n_paired += 2;
+        return;
+    }
+
+    if (waiting[next]) Evict(next);
+    Lookup same{read.Name(), read.NameLength(), fingerprint, read.IsFirstMate()};
+    bool added = slots.Insert(same, [&]() {
+        records[next].Assign(read);
+        fingerprints[next] = fingerprint;
+        waiting[next] = true;
+        return next;
+    });
+    if (added) next = (next + 1) % records.size();
+}
+
+void MateWindow::Finish() {
+    for (size_t i = 0; i < records.size(); ++i) {
+        uint32_t slot = (next + i) % records.size();
+        if (waiting[slot]) Evict(slot);
+    }
+}
+
+void MateWindow::Evict(uint32_t slot) {
+    const BamRecord &record = records[slot];
+    slots.Erase(Lookup{record.Name(), record.NameLength(), fingerprints[slot], record.IsFirstMate()});
+    waiting[slot] = false;
+    (record.IsFirstMate() ? first_out : second_out).SaveRecord(record);
+    n_unpaired++;
+}
+
+CollatedMates::CollatedMates(ClosingBamWriter &both_out, HalfMappedSorter &half_mapped)
+        : both_out(both_out), half_mapped(half_mapped) {}
+
+void CollatedMates::Add(const BamRecordView &read) {
+    if (!InGroup(read)) {
+        uint64_t fingerprint = name_fingerprint(read.Name(), read.NameLength());
+        if (recent_names.Contains(fingerprint)) {
+            throw CollationOrderException("Read " + std::string(read.Name(), read.NameLength()) +
+                                          " isn't collated with its mates");
+        }
+        if (recent.empty()) recent.resize(COLLATED_NAMES_CHECKED, 0);
+        if (recent[next_recent] != 0) recent_names.Erase(recent[next_recent]);
+        recent[next_recent] = fingerprint;
+        recent_names.Insert(fingerprint);
+        next_recent = (next_recent + 1) % recent.size();
+    }
+    Group(read);
+}
+
+bool CollatedMates::InGroup(const BamRecordView &read) const {
+    return name.size() == read.NameLength() && name.compare(0, name.size(), read.Name(), read.NameLength()) == 0;
+}
+
+void CollatedMates::Group(const BamRecordView &read) {
+    if (!InGroup(read)) {
+        PairGroup();
+        name.assign(read.Name(), read.NameLength());
+    }
+    Role role = read.IsMapped() ? MAPPED
+                                : read.IsMateMapped() ? UNMAPPED : read.IsFirstMate() ? FIRST_MATE : SECOND_MATE;
+    if (!seen[role]) {
+        reads[role].Assign(read);
+        seen[role] = true;
+    }
+}
+
+void CollatedMates::Finish() {
+    PairGroup();
+}
+
+void CollatedMates::PairGroup() {
+    if (seen[MAPPED] && seen[UNMAPPED]) {
+        half_mapped.Add(reads[MAPPED], reads[UNMAPPED]);
+    }
+    if (seen[FIRST_MATE] && seen[SECOND_MATE]) {
+        both_out.SaveRecord(reads[FIRST_MATE]);
+        both_out.SaveRecord(reads[SECOND_MATE]);
+        n_both += 2;
+    }
+    std::fill(seen, seen + N_ROLES, false);
+}
+
+BucketedMates::BucketedMates(ClosingBamWriter &both_out, HalfMappedSorter &half_mapped,
+                             const boost::filesystem::path &tmpdir, const BamTools::SamHeader &header,
+                             const BamTools::RefVector &references, size_t memory_limit, size_t n_buckets,
+                             const ReaderOptions &input_options, const WriterOptions &tmp_options)
+        : CollatedMates(both_out, half_mapped), tmpdir(tmpdir), header(header), references(references),
+          memory_limit(memory_limit > 0 ? memory_limit : DEFAULT_SORT_BYTES), n_buckets(n_buckets > 0 ? n_buckets : 1),
+          input_options(input_options), tmp_options(tmp_options) {}
+
+BucketedMates::~BucketedMates() {
+    writers.clear();
+    for (const auto &bucket : buckets) {
+        boost::filesystem::remove(bucket);
+    }
+}
+
+void BucketedMates::Add(const BamRecordView &read) {
+    uint64_t fingerprint = name_fingerprint(read.Name(), read.NameLength());
+    if (!writers.empty()) {
+        writers[name_partition(fingerprint, n_buckets)]->SaveRecord(read);
+        return;
+    }
+    Hold(read, fingerprint);
+    if (bytes > memory_limit) Spill();
+}
+
+void BucketedMates::Finish() {
+    if (writers.empty()) {
+        Collate();
+    }
+    else {
+        writers.clear();
+        std::cout << "[BucketedMates] Collating " << buckets.size() << " buckets of reads by name" << std::endl;
+        BamRecord read;
+        for (const auto &bucket : buckets) {
+            ClosingBamReader reader(bucket, input_options);
+            while (reader.GetNextRecord(read)) {
+                Hold(read, name_fingerprint(read.Name(), read.NameLength()));
+            }
+            Collate();
+        }
+    }
+    CollatedMates::Finish();
+}
+
+void BucketedMates::Hold(const BamRecordView &read, uint64_t fingerprint) {
+    reads.emplace_back();
+    reads.back().Assign(read);
+    fingerprints.push_back(fingerprint);
+    bytes += read.Size() + sizeof(BamRecord) + sizeof(uint64_t) + sizeof(size_t);
+}
+
+// Adds the reads held to the pairing, grouped by name. Sorting on fingerprints
+// first keeps the comparisons cheap, and names only tell apart those that share one.
+void BucketedMates::Collate() {
+    order.resize(reads.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+        if (fingerprints[a] != fingerprints[b]) return fingerprints[a] < fingerprints[b];
+        const BamRecord &x = reads[a];
+        const BamRecord &y = reads[b];
+        int compared = std::memcmp(x.Name(), y.Name(), std::min(x.NameLength(), y.NameLength()));
+        return compared < 0 || (compared == 0 && x.NameLength() < y.NameLength());
+    });
+    for (size_t i : order) {
+        Group(reads[i]);
+    }
+    reads.clear();
+    fingerprints.clear();
+    order.clear();
+    bytes = 0;
+}
+
+// Opens the buckets and moves the reads held into them
+void BucketedMates::Spill() {
+    std::cout << "[BucketedMates] Reads exceed " << memory_limit / 1048576.0 << " MB, splitting them into "
+              << n_buckets << " buckets by name" << std::endl;
+    WriterOptions bucket_options(tmp_options.compression_level, 0, false);
+    for (size_t i = 0; i < n_buckets; ++i) {
+        buckets.push_back(tmpdir / boost::filesystem::unique_path("tmp_collate_%%%%_%%%%.bam"));
+        writers.push_back(std::make_unique<ClosingBamWriter>(buckets.back(), header, references, bucket_options));
+    }
+    for (size_t i = 0; i < reads.size(); ++i) {
+        writers[name_partition(fingerprints[i], n_buckets)]->SaveRecord(reads[i]);
+    }
+    reads.clear();
+    fingerprints.clear();
+    bytes = 0;
+}
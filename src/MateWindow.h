@@ -0,0 +1,165 @@
+//
+// Pairing of reads with mates written close by, among the last few reads seen.
+//
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <boost/filesystem.hpp>
+#include "BamfileIO.h"
+#include "FingerprintSet.h"
+#include "FlatHashSet.h"
+#include "HalfMappedStream.h"
+
+#ifndef _MATEWINDOW_H
+#define _MATEWINDOW_H
+
+const size_t DEFAULT_MATE_WINDOW = 1024;
+const size_t DEFAULT_BUCKETS = 64;
+const size_t MAX_BUCKETS = 256;
+const size_t COLLATED_NAMES_CHECKED = size_t(1) << 18;
+
+struct CollationOrderException : public std::runtime_error {
+    CollationOrderException(const std::string &what) : std::runtime_error(what) {}
+};
+
+// Pairs first and second mates as they're added, for reads whose mates are
+// mostly written next to each other, as aligners write the unplaced reads at
+// the end of a sorted file. Each read waits in a ring of size slots, and is
+// paired with the first read of its name from the other mate to arrive while
+// it's there. Both are then written to paired_out, first mate first. Reads
+// pushed out of the ring, and those left by Finish, are written to first_out
+// or second_out, to be paired with any stragglers among their mates later.
+// A read of the same name and mate as one already waiting is dropped.
+class MateWindow {
+public:
+    MateWindow(ClosingBamWriter &paired_out, ClosingBamWriter &first_out, ClosingBamWriter &second_out,
+               size_t size = DEFAULT_MATE_WINDOW);
+    MateWindow(const MateWindow &) = delete;
+    MateWindow & operator=(const MateWindow &) = delete;
+
+    void Add(const BamRecordView &read);
+    // Writes the reads still waiting to first_out and second_out
+    void Finish();
+
+    unsigned long PairedWritten() const { return n_paired; }
+    unsigned long UnpairedWritten() const { return n_unpaired; }
+
+private:
+    struct Lookup {
+        const char *name;
+        size_t length;
+        uint64_t fingerprint;
+        bool first_mate;
+    };
+
+    struct Hash {
+        const std::vector<uint64_t> *fingerprints;
+        uint64_t operator()(uint32_t slot) const { return (*fingerprints)[slot]; }
+        uint64_t operator()(const Lookup &lookup) const { return lookup.fingerprint; }
+    };
+
+    struct Equal {
+        const std::vector<BamRecord> *records;
+        bool operator()(uint32_t slot, const Lookup &lookup) const;
+    };
+
+    void Evict(uint32_t slot);
+
+    ClosingBamWriter &paired_out;
+    ClosingBamWriter &first_out;
+    ClosingBamWriter &second_out;
+    std::vector<BamRecord> records;
+    std::vector<uint64_t> fingerprints;
+    std::vector<bool> waiting;
+    FlatHashSet<uint32_t, Hash, Equal> slots; // the waiting reads, by name and mate
+    uint32_t next = 0;                        // slot of the next read, the oldest if it's still waiting
+    unsigned long n_paired = 0;
+    unsigned long n_unpaired = 0;
+};
+
+// Pairs the reads of input collated by name, where the reads of a pair are
+// next to each other. Of the reads added for each name, the first mapped read
+// and first unmapped read of a half-mapped pair go to half_mapped, and the
+// first of each mate of a both-unmapped pair to both_out, first mate first.
+// Reads whose mates weren't added with them are dropped, as they have none.
+//
+// Add throws CollationOrderException for a read whose name was among the last
+// COLLATED_NAMES_CHECKED names before its own, so apart from the reads of its
+// name, after which the outputs are of no use. Input that only claims to be
+// collated is caught that way long before the end.
+class CollatedMates {
+public:
+    CollatedMates(ClosingBamWriter &both_out, HalfMappedSorter &half_mapped);
+    virtual ~CollatedMates() = default;
+
+    // Adds a read with at least one of its pair unmapped
+    virtual void Add(const BamRecordView &read);
+    // Pairs the reads of the last name added
+    virtual void Finish();
+
+    unsigned long BothWritten() const { return n_both; }
+
+protected:
+    // Adds a read known to be collated with the reads of its name
+    void Group(const BamRecordView &read);
+
+private:
+    enum Role { MAPPED, UNMAPPED, FIRST_MATE, SECOND_MATE, N_ROLES };
+
+    bool InGroup(const BamRecordView &read) const;
+    void PairGroup();
+
+    ClosingBamWriter &both_out;
+    HalfMappedSorter &half_mapped;
+    std::string name;         // of the reads held
+    BamRecord reads[N_ROLES]; // first read of the name in each role
+    bool seen[N_ROLES] = {false, false, false, false};
+    unsigned long n_both = 0;
+    std::vector<uint64_t> recent; // fingerprints of the last names, in a ring
+    size_t next_recent = 0;
+    FingerprintSet recent_names;
+};
+
+// Pairs the reads of input in any order, collating them by name first. Reads
+// are held until they take up more than memory_limit bytes, after which they
+// and those still to come are split by name into n_buckets temporary files in
+// tmpdir. Finish collates each bucket in memory in turn, so the reads are gone
+// over twice whatever their order. Reads of a name keep the order they were
+// added in, as CollatedMates picks the first of each role.
+class BucketedMates : public CollatedMates {
+public:
+    BucketedMates(ClosingBamWriter &both_out, HalfMappedSorter &half_mapped, const boost::filesystem::path &tmpdir,
+                  const BamTools::SamHeader &header, const BamTools::RefVector &references,
+                  size_t memory_limit = DEFAULT_SORT_BYTES, size_t n_buckets = DEFAULT_BUCKETS,
+                  const ReaderOptions &input_options = ReaderOptions(),
+                  const WriterOptions &tmp_options = WriterOptions());
+    ~BucketedMates() override;
+
+    void Add(const BamRecordView &read) override;
+    // Collates and pairs all the reads added
+    void Finish() override;
+
+private:
+    void Hold(const BamRecordView &read, uint64_t fingerprint);
+    void Collate();
+    void Spill();
+
+    boost::filesystem::path tmpdir;
+    BamTools::SamHeader header;
+    BamTools::RefVector references;
+    size_t memory_limit;
+    size_t n_buckets;
+    ReaderOptions input_options;
+    WriterOptions tmp_options;
+
+    std::vector<BamRecord> reads;
+    std::vector<uint64_t> fingerprints; // of the reads' names
+    std::vector<size_t> order;          // reads by name
+    size_t bytes = 0;
+    std::vector<boost::filesystem::path> buckets;
+    std::vector<std::unique_ptr<ClosingBamWriter>> writers;
+};
+
+#endif //_MATEWINDOW_H
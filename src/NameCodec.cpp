@@ -0,0 +1,76 @@
+//
+// Packing of Illumina-style read names into pairs of integers.
+//
+
+#include <cstring>
+#include "NameCodec.h"
+
+// Parses the decimal field ending just before end, moving end to the field's
+// first character. Returns false if it isn't a number no greater than max.
+static bool parse_field(const char *begin, const char *&end, uint64_t max, uint64_t &value) {
+    const char *p = end;
+    while (p > begin && p[-1] >= '0' && p[-1] <= '9' && end - p < 11) --p;
+    size_t digits = size_t(end - p);
+    if (digits == 0 || digits > 10 || (digits > 1 && *p == '0')) return false;
+    value = 0;
+    for (const char *d = p; d < end; ++d) {
+        value = value * 10 + uint64_t(*d - '0');
+    }
+    end = p;
+    return value <= max;
+}
+
+NameForm NameCodec::Pack(const char *name, size_t length, PackedName &packed, bool add) {
+    // Fields are taken from the end: y, x, tile and lane, each after a colon
+    const uint64_t max[4] = {0xffffffff, 0xffffffff, 0xffffff, 0xffff};
+    uint64_t fields[4];
+    const char *end = name + length;
+    for (size_t i = 0; i < 4; ++i) {
+        if (!parse_field(name, end, max[i], fields[i]) || end == name || *--end != ':') {
+            return NameForm::Raw;
+        }
+    }
+    size_t prefix_length = size_t(end - name);
+
+    uint32_t id;
+    if (last_id < prefixes.size() && prefixes[last_id].size() == prefix_length &&
+        std::memcmp(prefixes[last_id].data(), name, prefix_length) == 0) {
+        id = last_id;
+    }
+    else {
+        scratch.assign(name, prefix_length);
+        auto search = prefix_ids.find(scratch);
+        if (search != prefix_ids.end()) {
+            id = search->second;
+        }
+        else if (prefixes.size() >= max_prefixes) {
+            return NameForm::Raw;
+        }
+        else if (!add) {
+            return NameForm::Unknown;
+        }
+        else {
+            id = uint32_t(prefixes.size());
+            prefixes.push_back(scratch);
+            prefix_ids.emplace(scratch, id);
+        }
+        last_id = id;
+    }
+    packed.hi = uint64_t(id) << 40 | fields[3] << 24 | fields[2];
+    packed.lo = fields[1] << 32 | fields[0];
+    return NameForm::Packed;
+}
+
+void NameCodec::Unpack(const PackedName &packed, std::string &name) const {
+    name = prefixes[packed.hi >> 40];
+    for (uint64_t field : {(packed.hi >> 24) & 0xffff, packed.hi & 0xffffff, packed.lo >> 32, packed.lo & 0xffffffff}) {
+        name += ':';
+        name += std::to_string(field);
+    }
+}
+
+void NameCodec::Clear() {
+    prefixes.clear();
+    prefix_ids.clear();
+    last_id = 0;
+}
@@ -0,0 +1,57 @@
+//
+// Packing of Illumina-style read names into pairs of integers.
+//
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifndef _NAMECODEC_H
+#define _NAMECODEC_H
+
+// A read name as two words. Illumina names end in lane:tile:x:y after the
+// instrument, run and flowcell (or, in older names, just the instrument),
+// and that prefix is numbered by the codec that packed the name:
+//   hi = prefix id (24 bits) | lane (16) | tile (24), lo = x (32) | y (32)
+// Two names packed by the same codec are equal just when their words are.
+struct PackedName {
+    uint64_t hi = 0;
+    uint64_t lo = 0;
+};
+
+enum class NameForm {
+    Packed,  // name was packed
+    Raw,     // name isn't in lane:tile:x:y form, or its fields are out of range
+    Unknown  // name would pack, but its prefix hasn't been seen
+};
+
+// Packs names, numbering their prefixes in the order they're first seen.
+// Only names whose fields are plain decimal numbers (no sign, no leading
+// zeros) are packed, so that packing is one-to-one and Unpack gives back
+// the name exactly.
+class NameCodec {
+public:
+    static const uint32_t MAX_PREFIXES = (1u << 24) - 1;
+
+    // Numbers up to max_prefixes prefixes (at most MAX_PREFIXES); names with
+    // any others are Raw
+    explicit NameCodec(uint32_t max_prefixes = MAX_PREFIXES) : max_prefixes(max_prefixes) {}
+
+    // Packs name. With add unset, a prefix not seen before isn't numbered, and
+    // Unknown is returned: no name packed so far has it. Once all prefixes
+    // are numbered, names with another are Raw whether or not add is set, so
+    // that they're looked up as they were added.
+    NameForm Pack(const char *name, size_t length, PackedName &packed, bool add);
+    void Unpack(const PackedName &packed, std::string &name) const;
+    void Clear();
+
+private:
+    uint32_t max_prefixes;
+    std::vector<std::string> prefixes;
+    std::unordered_map<std::string, uint32_t> prefix_ids;
+    std::string scratch;
+    uint32_t last_id = 0; // names mostly share a prefix, so the last is tried first
+};
+
+#endif //_NAMECODEC_H
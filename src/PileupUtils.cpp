@@ -17,8 +17,8 @@ std::string Region::toString() {
     return s.str();
 }
 
-bool Region::fullyLeftOf(const BamTools::BamAlignment &r) {
-    return (ref_id < r.RefID || (ref_id == r.RefID && end < r.Position));
+bool Region::fullyLeftOf(const BamRecordView &r) {
+    return (ref_id < r.RefID() || (ref_id == r.RefID() && end < r.Position()));
 }
 
 void CoverageVisitor::Visit(const BamTools::PileupPosition& pileupdata) {
@@ -51,14 +51,20 @@ void CoverageVisitor::Finalise() {
     }
 }
 
-bool Region::overlaps(const BamTools::BamAlignment &read) {
+bool CoverageVisitor::InProgress(Region &region) const {
+    if (!initialised) return false;
+    region = Region(refid, start, end);
+    return true;
+}
+
+bool Region::overlaps(const BamRecordView &read) {
     bool use_mate_info = false;
     if (read.IsMapped()) use_mate_info = false;
     else if (read.IsMateMapped()) use_mate_info = true;
     else return false;
-    auto read_start = use_mate_info ? read.MatePosition : read.Position;
-    auto read_end = use_mate_info ? read_start + read.Length : read.GetEndPosition();
-    auto read_ref_id = use_mate_info ? read.MateRefID : read.RefID;
+    auto read_start = use_mate_info ? read.MatePosition() : read.Position();
+    auto read_end = use_mate_info ? read_start + read.Length() : read.GetEndPosition();
+    auto read_ref_id = use_mate_info ? read.MateRefID() : read.RefID();
     return (read_ref_id == this->ref_id &&
             read_start <= this->end &&
             read_end > this->start);
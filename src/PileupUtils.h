@@ -5,6 +5,7 @@
 #include <api/BamMultiReader.h>
 #include <api/BamReader.h>
 #include <utils/bamtools_pileup_engine.h>
+#include "BamRecord.h"
 
 #ifndef _PILEUPUTILS_H
 #define _PILEUPUTILS_H
@@ -12,8 +13,8 @@
 struct Region {
     Region(unsigned long r, unsigned long s, unsigned long e): ref_id(r), start(s), end(e) {}
     std::string toString();
-    bool fullyLeftOf(const BamTools::BamAlignment &r);
-    bool overlaps(const BamTools::BamAlignment &r);
+    bool fullyLeftOf(const BamRecordView &r);
+    bool overlaps(const BamRecordView &r);
     unsigned long ref_id;
     unsigned long start;
     unsigned long end;
@@ -26,6 +27,8 @@ public:
     void Visit(const BamTools::PileupPosition& pileupdata);
     void Initialise(const BamTools::PileupPosition& pileupdata);
     void Finalise();
+    // Sets region to the one being extended, if there is one, as far as it reaches so far
+    bool InProgress(Region &region) const;
 
     std::vector<Region> regions;
     int mincoverage;
@@ -0,0 +1,210 @@
+//
+// Asynchronous sequential file input used by BgzfReader.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ReadAhead.h"
+
+static const size_t READ_AHEAD_MAX_WORKERS = 4;
+
+// Reads length bytes at offset, retrying interrupted and partial reads.
+// Returns the number of bytes read, short only at end of file, or -errno.
+static ssize_t read_fully(int fd, char *dest, size_t length, uint64_t offset) {
+    size_t total = 0;
+    while (total < length) {
+        ssize_t n = pread(fd, dest + total, length - total, off_t(offset + total));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        if (n == 0) break;
+        total += size_t(n);
+    }
+    return ssize_t(total);
+}
+
+// Opens filename and submits the first depth reads. If it isn't a regular
+// file the reader is left closed, for the caller to fall back to plain reads.
+ReadAhead::ReadAhead(const std::string &filename, size_t depth)
+        : filename(filename), chunks(std::max<size_t>(depth, 1)) {
+    fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        fd = -1;
+        return;
+    }
+    file_size = uint64_t(st.st_size);
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+#ifdef HAVE_LIBURING
+    use_uring = io_uring_queue_init(unsigned(chunks.size()), &ring, 0) == 0;
+    if (!use_uring)
+#endif
+    {
+        size_t n_workers = std::min(chunks.size(), READ_AHEAD_MAX_WORKERS);
+        for (size_t i = 0; i < n_workers; ++i) {
+            workers.emplace_back(&ReadAhead::Worker, this);
+        }
+    }
+
+    for (auto &chunk : chunks) {
+        chunk.data.resize(READ_AHEAD_CHUNK_SIZE);
+        Submit(chunk);
+    }
+}
+
+ReadAhead::~ReadAhead() {
+    Close();
+}
+
+bool ReadAhead::IsOpen() const {
+    return fd >= 0;
+}
+
+// Waits for reads still in flight, since they write into the chunk buffers
+void ReadAhead::Close() {
+    if (fd < 0) return;
+#ifdef HAVE_LIBURING
+    if (use_uring) {
+        for (auto &chunk : chunks) {
+            if (chunk.length > 0) Wait(chunk);
+        }
+        io_uring_queue_exit(&ring);
+        use_uring = false;
+    }
+#endif
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    has_request.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+    close(fd);
+    fd = -1;
+}
+
+size_t ReadAhead::Read(char *dest, size_t length) {
+    size_t copied = 0;
+    while (copied < length && fd >= 0) {
+        Chunk &chunk = chunks[head];
+        if (chunk.length == 0) break; // end of file
+        Wait(chunk);
+        if (chunk.result < 0) {
+            throw ReadAheadException("Couldn't read " + filename + ": " + std::strerror(int(-chunk.result)));
+        }
+
+        size_t n = std::min(length - copied, size_t(chunk.result) - head_pos);
+        std::memcpy(dest + copied, chunk.data.data() + head_pos, n);
+        head_pos += n;
+        copied += n;
+
+        if (head_pos == size_t(chunk.result)) {
+            // A short chunk means the file ended early; don't read past it
+            bool truncated = size_t(chunk.result) < chunk.length;
+            chunk.length = 0;
+            if (!truncated) Submit(chunk);
+            head = (head + 1) % chunks.size();
+            head_pos = 0;
+            if (truncated) break;
+        }
+    }
+    return copied;
+}
+
+// Queues a read of the next chunk of the file into chunk
+void ReadAhead::Submit(Chunk &chunk) {
+    if (next_offset >= file_size) return;
+    chunk.offset = next_offset;
+    chunk.length = size_t(std::min<uint64_t>(READ_AHEAD_CHUNK_SIZE, file_size - next_offset));
+    chunk.result = 0;
+    chunk.done = false;
+    next_offset += chunk.length;
+
+#ifdef HAVE_LIBURING
+    if (use_uring) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+        if (sqe) {
+            io_uring_prep_read(sqe, fd, chunk.data.data(), unsigned(chunk.length), chunk.offset);
+            io_uring_sqe_set_data(sqe, &chunk);
+            if (io_uring_submit(&ring) >= 0) return;
+        }
+        // The ring never holds more entries than chunks, so this shouldn't
+        // happen; read synchronously rather than fail
+        chunk.result = read_fully(fd, chunk.data.data(), chunk.length, chunk.offset);
+        chunk.done = true;
+        return;
+    }
+#endif
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        requests.push_back(&chunk);
+    }
+    has_request.notify_one();
+}
+
+void ReadAhead::Wait(Chunk &chunk) {
+#ifdef HAVE_LIBURING
+    if (use_uring) {
+        // Completions may arrive out of order, so record each one until this chunk's
+        while (!chunk.done) {
+            struct io_uring_cqe *cqe;
+            int status = io_uring_wait_cqe(&ring, &cqe);
+            if (status == -EINTR) continue;
+            if (status < 0) {
+                throw ReadAheadException("Couldn't read " + filename + ": " + std::strerror(-status));
+            }
+            Chunk *completed = static_cast<Chunk *>(io_uring_cqe_get_data(cqe));
+            completed->result = cqe->res;
+            completed->done = true;
+            io_uring_cqe_seen(&ring, cqe);
+            Complete(*completed);
+        }
+        return;
+    }
+#endif
+    std::unique_lock<std::mutex> lock(mutex);
+    has_result.wait(lock, [&chunk] { return chunk.done; });
+}
+
+// Finishes a read that io_uring returned short of the end of the file, or
+// retries one it gave up on
+void ReadAhead::Complete(Chunk &chunk) {
+    if (chunk.result == -EAGAIN || chunk.result == -EINTR) chunk.result = 0;
+    if (chunk.result < 0 || size_t(chunk.result) == chunk.length) return;
+    ssize_t rest = read_fully(fd, chunk.data.data() + chunk.result, chunk.length - size_t(chunk.result),
+                              chunk.offset + uint64_t(chunk.result));
+    chunk.result = rest < 0 ? rest : chunk.result + rest;
+}
+
+void ReadAhead::Worker() {
+    while (true) {
+        Chunk *chunk;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            has_request.wait(lock, [this] { return stopping || !requests.empty(); });
+            if (stopping) return;
+            chunk = requests.front();
+            requests.pop_front();
+        }
+        ssize_t result = read_fully(fd, chunk->data.data(), chunk->length, chunk->offset);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            chunk->result = result;
+            chunk->done = true;
+        }
+        has_result.notify_all();
+    }
+}
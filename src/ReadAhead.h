@@ -0,0 +1,78 @@
+//
+// Asynchronous sequential file input used by BgzfReader.
+//
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#ifndef _READAHEAD_H
+#define _READAHEAD_H
+
+const size_t READ_AHEAD_CHUNK_SIZE = 65536; // bytes per read, the largest a BGZF block can be
+
+struct ReadAheadException : public std::runtime_error {
+    ReadAheadException(const std::string &what) : std::runtime_error(what) {}
+};
+
+// Reads a regular file front to back while keeping up to depth reads of
+// READ_AHEAD_CHUNK_SIZE bytes in flight beyond the consumer's position, so
+// the consumer only waits on I/O when it catches up with the device.
+// Reads go through io_uring when built with liburing and the kernel allows
+// it, and otherwise through pread on a small pool of threads.
+// Not thread-safe: callers serialise Read themselves.
+class ReadAhead {
+public:
+    ReadAhead(const std::string &filename, size_t depth);
+    ~ReadAhead();
+    bool IsOpen() const;
+    void Close();
+    size_t Read(char *dest, size_t length);
+
+private:
+    struct Chunk {
+        std::vector<char> data;
+        uint64_t offset = 0;
+        size_t length = 0;    // bytes requested, 0 if nothing was submitted
+        ssize_t result = 0;   // bytes read, or -errno
+        bool done = false;
+    };
+
+    void Submit(Chunk &chunk);
+    void Wait(Chunk &chunk);
+    void Complete(Chunk &chunk);
+    void Worker();
+
+    std::string filename;
+    int fd = -1;
+    uint64_t file_size = 0;
+    uint64_t next_offset = 0;
+
+    // Ring of chunks in file order; head is the one being consumed
+    std::vector<Chunk> chunks;
+    size_t head = 0;
+    size_t head_pos = 0;
+
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+    bool use_uring = false;
+#endif
+
+    // Thread pool fallback
+    std::vector<std::thread> workers;
+    std::deque<Chunk *> requests;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable has_request;
+    std::condition_variable has_result;
+};
+
+#endif //_READAHEAD_H
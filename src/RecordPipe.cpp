@@ -0,0 +1,107 @@
+//
+// Handing serialised BAM records to a consumer on a thread of its own.
+//
+
+#include <chrono>
+#include "RecordPipe.h"
+
+// Waits a little longer each time a queue is found full or empty: spinning,
+// then yielding, then sleeping, so an idle side doesn't hold on to a core
+static void back_off(unsigned &waits) {
+    if (waits < 64) {
+        waits++;
+    }
+    else if (waits < 128) {
+        waits++;
+        std::this_thread::yield();
+    }
+    else {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+}
+
+RecordPipe::RecordPipe(std::function<void(const BamRecordView &)> consume, size_t depth, size_t batch_bytes)
+        : consume(std::move(consume)), batch_bytes(batch_bytes > 0 ? batch_bytes : DEFAULT_PIPE_BATCH_BYTES),
+          full(depth > 0 ? depth : 1), empty(depth > 0 ? depth + 1 : 2) {
+    batch.reserve(this->batch_bytes);
+    consumer = std::thread(&RecordPipe::Consume, this);
+}
+
+RecordPipe::~RecordPipe() {
+    if (!closed) {
+        closed = true;
+        Stop();
+    }
+}
+
+void RecordPipe::Add(const BamRecordView &read) {
+    uint32_t size = read.Size();
+    const char *prefix = reinterpret_cast<const char *>(&size);
+    batch.insert(batch.end(), prefix, prefix + 4);
+    batch.insert(batch.end(), read.Data(), read.Data() + size);
+    if (batch.size() >= batch_bytes) Push();
+}
+
+void RecordPipe::Close() {
+    if (closed) return;
+    if (!batch.empty()) Push();
+    closed = true;
+    Stop();
+    if (error) std::rethrow_exception(error);
+}
+
+// Queues the batch being filled and takes an emptied one in its place
+void RecordPipe::Push() {
+    unsigned waits = 0;
+    while (true) {
+        if (failed.load(std::memory_order_acquire)) {
+            closed = true;
+            consumer.join();
+            std::rethrow_exception(error);
+        }
+        if (full.TryPush(batch)) break;
+        back_off(waits);
+    }
+    if (!empty.TryPop(batch)) {
+        batch = std::vector<char>();
+        batch.reserve(batch_bytes);
+    }
+}
+
+// Queues the empty batch that ends the stream, unless the consumer has
+// stopped already, and waits for the consumer to finish
+void RecordPipe::Stop() {
+    batch.clear();
+    unsigned waits = 0;
+    while (!failed.load(std::memory_order_acquire) && !full.TryPush(batch)) {
+        back_off(waits);
+    }
+    if (consumer.joinable()) consumer.join();
+}
+
+void RecordPipe::Consume() {
+    std::vector<char> data;
+    unsigned waits = 0;
+    while (true) {
+        if (!full.TryPop(data)) {
+            back_off(waits);
+            continue;
+        }
+        waits = 0;
+        if (data.empty()) return;
+        try {
+            for (size_t offset = 0; offset < data.size();) {
+                uint32_t size = unpack<uint32_t>(data.data() + offset);
+                consume(BamRecordView(data.data() + offset + 4, size));
+                offset += 4 + size;
+            }
+        }
+        catch (...) {
+            error = std::current_exception();
+            failed.store(true, std::memory_order_release);
+            return;
+        }
+        data.clear();
+        empty.TryPush(data);
+    }
+}
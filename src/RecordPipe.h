@@ -0,0 +1,89 @@
+//
+// Handing serialised BAM records to a consumer on a thread of its own.
+//
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <thread>
+#include <vector>
+#include "BamRecord.h"
+
+#ifndef _RECORDPIPE_H
+#define _RECORDPIPE_H
+
+const size_t DEFAULT_PIPE_BATCH_BYTES = 1 << 18;
+
+// Bounded ring for one producer thread and one consumer thread. Neither side
+// takes a lock: each owns one index and only reads the other's, with release
+// stores publishing the slots it has finished with.
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity) : slots(capacity + 1) {}
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue & operator=(const SpscQueue &) = delete;
+
+    // Moves item in unless the ring is full
+    bool TryPush(T &item) {
+        size_t tail = this->tail.load(std::memory_order_relaxed);
+        size_t next = tail + 1 == slots.size() ? 0 : tail + 1;
+        if (next == head.load(std::memory_order_acquire)) return false;
+        slots[tail] = std::move(item);
+        this->tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // Moves the oldest item out unless the ring is empty
+    bool TryPop(T &item) {
+        size_t head = this->head.load(std::memory_order_relaxed);
+        if (head == tail.load(std::memory_order_acquire)) return false;
+        item = std::move(slots[head]);
+        this->head.store(head + 1 == slots.size() ? 0 : head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::vector<T> slots;
+    alignas(64) std::atomic<size_t> head{0}; // next slot to pop, written by the consumer
+    alignas(64) std::atomic<size_t> tail{0}; // next slot to push, written by the producer
+};
+
+// Passes the records added to consume, in the order they were added, on a
+// thread of its own. Records are copied into batches of about batch_bytes,
+// up to depth of which wait in an SpscQueue, so the producer only waits when
+// the consumer is that far behind. Emptied batches go back through a second
+// queue to be refilled. A waiting side spins briefly and then backs off to
+// short sleeps, rather than blocking on a lock.
+//
+// If consume throws, the pipe stops, and Add or Close rethrows the exception
+// to the producer. The destructor stops the pipe without throwing.
+class RecordPipe {
+public:
+    RecordPipe(std::function<void(const BamRecordView &)> consume, size_t depth,
+               size_t batch_bytes = DEFAULT_PIPE_BATCH_BYTES);
+    RecordPipe(const RecordPipe &) = delete;
+    RecordPipe & operator=(const RecordPipe &) = delete;
+    ~RecordPipe();
+
+    void Add(const BamRecordView &read);
+    // Waits for the records added to be consumed
+    void Close();
+
+private:
+    void Push();
+    void Consume();
+    void Stop();
+
+    std::function<void(const BamRecordView &)> consume;
+    size_t batch_bytes;
+    std::vector<char> batch;  // size-prefixed records; an empty batch ends the stream
+    SpscQueue<std::vector<char>> full;
+    SpscQueue<std::vector<char>> empty;
+    std::atomic<bool> failed{false};
+    std::exception_ptr error;
+    std::thread consumer;
+    bool closed = false;
+};
+
+#endif //_RECORDPIPE_H
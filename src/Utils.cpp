@@ -2,78 +2,653 @@
 // Created by Kevin Gori on 25/02/2017.
 //
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <future>
+#include <mutex>
 #include <string>
-#include <unordered_set>
 #include "BamfileIO.h"
+#include "BloomFilter.h"
+#include "FingerprintSet.h"
 #include "Utils.h"
 
 using namespace BamTools;
 namespace fs = boost::filesystem;
 
-int filter_bam(fs::path query, fs::path subject, fs::path tmpdir, fs::path outfile, int at_a_time) {
+// Concatenates BAMs with a common header into outfile by copying their
+// compressed blocks, so records are neither decoded nor recompressed. Records
+// keep their order within each input, inputs following one another, so this
+// only suits outputs where the order across inputs doesn't matter. The output
+// isn't indexed. Returns false if an input couldn't be read.
+bool concatenate_bam(const std::vector<fs::path> &inputs, fs::path outfile, const WriterOptions &options) {
+    if (inputs.empty()) return false;
+    std::unique_ptr<ClosingBamWriter> writer;
+    BgzfBlock block;
+    for (auto &path : inputs) {
+        ClosingBamReader reader(path);
+        if (!reader.IsOpen()) return false;
+        if (!writer) {
+            writer = std::make_unique<ClosingBamWriter>(outfile, reader.GetConstSamHeader(),
+                                                        reader.GetReferenceData(), options);
+        }
+        while (reader.GetNextRawBlock(block)) {
+            writer->SaveRawBlock(block);
+        }
+    }
+    writer->Close();
+    return true;
+}
+
+static const size_t MAX_PARTITIONS = 256;
+
+// Smallest batch of names worth a Bloom filter, for which a FingerprintSet
+// takes 1 MB
+static const size_t PREFILTER_MIN_NAMES = 1 << 16;
+
+// Names read to estimate their length before a memory budget is divided up
+static const size_t BUDGET_SAMPLE_NAMES = 1000;
+
+// Query names loaded for a join. Normally only their fingerprints are kept,
+// so a subject read whose name shares a fingerprint with a query name (odds
+// of about 1 in 10^12 per read for a million names) is taken for a mate.
+// With exact set, whole names are kept and compared.
+//
+// Once a batch is loaded, Seal puts a Bloom filter in front of sets too big
+// to stay in cache, so the subject reads that match nothing, which are most
+// of them, are turned away after touching one cache line.
+//
+// Names are split by fingerprint among n_shards sets, so that threads can
+// erase names concurrently, each from a shard of its own (see ShardOf).
+class NameSet {
+public:
+    NameSet(bool exact, size_t n_shards = 1) : exact(exact), shards(std::max<size_t>(n_shards, 1)) {}
+
+    void Insert(const char *name, size_t length) {
+        Insert(name, length, name_fingerprint(name, length));
+    }
+
+    size_t Shards() const { return shards.size(); }
+    size_t ShardOf(uint64_t fingerprint) const { return name_partition(fingerprint, shards.size()); }
+
+    // Most names a batch can hold in budget bytes, going by the names inserted
+    // so far: how many ExactNameSet had to keep in its arena, and how long
+    size_t BatchSize(size_t budget) const {
+        size_t arena_bytes = 0;
+        for (const auto &shard : shards) arena_bytes += shard.names.ArenaBytes();
+        double name_length = exact && Size() > 0 ? double(arena_bytes) / Size() : 0;
+        // Tables grow by doubling from 3/4 full, and briefly hold the old one
+        // too. The arena's vector can likewise double its capacity.
+        auto cost = [&](size_t n) {
+            size_t per_shard = (n + shards.size() - 1) / shards.size();
+            size_t slots = 16;
+            while (slots * 3 < per_shard * 4) slots *= 2;
+            double slot_bytes = exact ? sizeof(PackedName) + 1 : 8;
+            return slots * shards.size() * slot_bytes * 1.5 + n * name_length * 2 + n * 10 / 8.0;
+        };
+        size_t lo = 1, hi = 2;
+        while (cost(hi) <= budget) {
+            lo = hi;
+            hi *= 2;
+        }
+        while (hi - lo > 1) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (cost(mid) <= budget) lo = mid;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+    void Seal() {
+        filtered = Size() >= PREFILTER_MIN_NAMES;
+        if (!filtered) return;
+        filter.Reset(Size());
+        for (const auto &shard : shards) {
+            if (exact) {
+                shard.names.ForEach([this](const char *name, size_t length) {
+                    filter.Insert(name_fingerprint(name, length));
+                });
+            }
+            else {
+                shard.fingerprints.ForEach([this](uint64_t fingerprint) { filter.Insert(fingerprint); });
+            }
+        }
+    }
+
+    // Removes the name, returning whether it was present. Safe to call from
+    // several threads once sealed, for names of different shards.
+    bool Erase(const char *name, size_t length, uint64_t fingerprint) {
+        if (filtered && !filter.MayContain(fingerprint)) return false;
+        Shard &shard = shards[ShardOf(fingerprint)];
+        return exact ? shard.names.Erase(name, length, fingerprint) : shard.fingerprints.Erase(fingerprint);
+    }
+
+    size_t Size() const {
+        size_t size = 0;
+        for (const auto &shard : shards) size += exact ? shard.names.Size() : shard.fingerprints.Size();
+        return size;
+    }
+    bool Empty() const { return Size() == 0; }
+    void Clear() {
+        for (auto &shard : shards) {
+            shard.names.Clear();
+            shard.fingerprints.Clear();
+        }
+        filtered = false;
+    }
+
+    // Partition files hold whole names in exact mode, and fingerprints otherwise
+    void Spill(std::vector<std::unique_ptr<BgzfWriter>> &partitions) const {
+        for (const auto &shard : shards) {
+            if (exact) {
+                shard.names.ForEach([&](const char *name, size_t length) {
+                    Spill(name, uint32_t(length), name_fingerprint(name, length), partitions);
+                });
+            }
+            else {
+                shard.fingerprints.ForEach([&](uint64_t fingerprint) {
+                    Spill(nullptr, 0, fingerprint, partitions);
+                });
+            }
+        }
+    }
+
+    void Spill(const char *name, uint32_t length, uint64_t fingerprint,
+               std::vector<std::unique_ptr<BgzfWriter>> &partitions) const {
+        auto &writer = partitions[name_partition(fingerprint, partitions.size())];
+        if (exact) {
+            writer->Write(reinterpret_cast<const char *>(&length), 4);
+            writer->Write(name, length);
+        }
+        else {
+            writer->Write(reinterpret_cast<const char *>(&fingerprint), 8);
+        }
+    }
+
+    // Loads up to limit names from a partition file. Returns the number read.
+    size_t Load(BgzfReader &reader, size_t limit) {
+        char field[8];
+        size_t n = 0;
+        for (; n < limit; ++n) {
+            if (!exact) {
+                if (reader.Read(field, 8) != 8) break;
+                Insert(nullptr, 0, unpack<uint64_t>(field));
+                continue;
+            }
+            if (reader.Read(field, 4) != 4) break;
+            scratch.resize(unpack<uint32_t>(field));
+            if (reader.Read(&scratch[0], scratch.size()) != scratch.size()) {
+                throw BamFormatException("Truncated read name partition");
+            }
+            Insert(scratch.data(), scratch.size(), name_fingerprint(scratch.data(), scratch.size()));
+        }
+        return n;
+    }
+
+private:
+    struct Shard {
+        ExactNameSet names;
+        FingerprintSet fingerprints;
+    };
+
+    void Insert(const char *name, size_t length, uint64_t fingerprint) {
+        Shard &shard = shards[ShardOf(fingerprint)];
+        if (exact) shard.names.Insert(name, length, fingerprint);
+        else shard.fingerprints.Insert(fingerprint);
+        filtered = false;
+    }
+
+    bool exact;
+    std::vector<Shard> shards;
+    BloomFilter filter;
+    bool filtered = false;
+    std::string scratch;
+};
+
+// Adds the names of up to limit records from reader to names. Returns false
+// if the reader ran out first. A record past the limit is read to tell, and
+// kept, so a query of exactly limit records counts as having run out.
+static bool load_names(ClosingBamReader &reader, NameSet &names, size_t limit) {
+    BamRecordView read;
+    for (size_t n = 0; n <= limit; ++n) {
+        if (!reader.GetNextRecordView(read)) return false;
+        names.Insert(read.Name(), read.NameLength());
+    }
+    return true;
+}
+
+// Subject records copied out at a time for a sharded join
+static const size_t JOIN_CHUNK_RECORDS = 1 << 16;
+
+// Writes the first record of subject with each of the names, removing names
+// as they're matched. Returns the number of records written.
+//
+// With names in more than one shard, subject is read in chunks, and each
+// shard's thread looks up the records of the chunk whose names fall in it.
+// The matches are then written in subject order, so each record is read once
+// and the output is the same as from one thread.
+static int join_names(NameSet &names, ClosingBamReader &subject_reader, ClosingBamWriter &writer) {
+    int written = 0;
+    BamRecordView read;
+    if (names.Shards() == 1) {
+        while (!names.Empty() && subject_reader.GetNextRecordView(read)) {
+            if (names.Erase(read.Name(), read.NameLength(), name_fingerprint(read.Name(), read.NameLength()))) {
+                writer.SaveRecord(read);
+                written++;
+            }
+        }
+        return written;
+    }
+
+    std::vector<BamRecord> chunk(JOIN_CHUNK_RECORDS);
+    std::vector<uint64_t> fingerprints(JOIN_CHUNK_RECORDS);
+    std::vector<char> matched(JOIN_CHUNK_RECORDS);
+    auto join_shard = [&](size_t shard, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            if (names.ShardOf(fingerprints[i]) != shard) continue;
+            matched[i] = names.Erase(chunk[i].Name(), chunk[i].NameLength(), fingerprints[i]);
+        }
+    };
+    bool more = true;
+    while (more && !names.Empty()) {
+        size_t n = 0;
+        while (n < chunk.size() && (more = subject_reader.GetNextRecordView(read))) {
+            chunk[n].Assign(read);
+            fingerprints[n] = name_fingerprint(read.Name(), read.NameLength());
+            n++;
+        }
+        std::fill(matched.begin(), matched.begin() + n, 0);
+        std::vector<std::future<void>> shards;
+        for (size_t shard = 1; shard < names.Shards(); ++shard) {
+            shards.push_back(std::async(std::launch::async, join_shard, shard, n));
+        }
+        join_shard(0, n);
+        for (auto &shard : shards) shard.get();
+        for (size_t i = 0; i < n; ++i) {
+            if (matched[i]) {
+                writer.SaveRecord(chunk[i]);
+                written++;
+            }
+        }
+    }
+    return written;
+}
+
+static std::unique_ptr<BgzfWriter> open_spill(const fs::path &path, int compression_level) {
+    auto writer = std::make_unique<BgzfWriter>(path.string(), compression_level);
+    if (!writer->IsOpen()) {
+        throw BgzfException("Couldn't open " + path.string() + " for writing");
+    }
+    return writer;
+}
+
+// Splits the query names into n_partitions files in tmpdir: those already
+// loaded are written out, followed by the rest of reader.
+static std::vector<fs::path> partition_names(ClosingBamReader &reader, const NameSet &loaded,
+                                             const fs::path &tmpdir, const std::string &stem, size_t n_partitions,
+                                             int compression_level) {
+    std::vector<fs::path> paths;
+    std::vector<std::unique_ptr<BgzfWriter>> writers;
+    for (size_t i = 0; i < n_partitions; ++i) {
+        paths.push_back(tmpdir / fs::unique_path(stem + "_%%%%_%%%%.names"));
+        writers.push_back(open_spill(paths.back(), compression_level));
+    }
+    loaded.Spill(writers);
+    BamRecordView read;
+    while (reader.GetNextRecordView(read)) {
+        loaded.Spill(read.Name(), read.NameLength(), name_fingerprint(read.Name(), read.NameLength()), writers);
+    }
+    for (auto &writer : writers) {
+        writer->Close();
+    }
+    return paths;
+}
+
+// Subject records spilled to a temporary file, each tagged with its ordinal
+// in the subject. Entries are the ordinal, then either the record as stored
+// in a BAM (block_size and all) or, when the matches will be picked out of
+// the subject again by ordinal, just the length and bytes of its name.
+static void write_entry(BgzfWriter &writer, uint64_t ordinal, const char *data, uint32_t size) {
+    writer.Write(reinterpret_cast<const char *>(&ordinal), 8);
+    writer.Write(reinterpret_cast<const char *>(&size), 4);
+    writer.Write(data, size);
+}
+
+struct EntryReader {
+    EntryReader(const fs::path &path, bool names_only) : stream(path.string()), names_only(names_only) {}
+
+    // The name and record are only valid until the next call
+    bool Next() {
+        char field[12];
+        size_t n = stream.Read(field, 12);
+        if (n == 0) return false;
+        uint32_t size = unpack<uint32_t>(field + 8);
+        const char *data = n == 12 ? stream.ReadSpan(size, scratch) : nullptr;
+        if (!data) throw BamFormatException("Truncated record partition");
+        ordinal = unpack<uint64_t>(field);
+        if (names_only) {
+            name = data;
+            name_length = size;
+        }
+        else {
+            record = BamRecordView(data, size);
+            name = record.Name();
+            name_length = record.NameLength();
+        }
+        return true;
+    }
+
+    BgzfReader stream;
+    bool names_only;
+    std::vector<char> scratch;
+    uint64_t ordinal = 0;
+    const char *name = nullptr;
+    size_t name_length = 0;
+    BamRecordView record;
+};
+
+// Splits the records of subject into n_partitions files in tmpdir, each
+// keeping the subject's record order. Returns the paths and sets n_records.
+static std::vector<fs::path> partition_records(ClosingBamReader &reader, const fs::path &tmpdir,
+                                               const std::string &stem, size_t n_partitions,
+                                               int compression_level, bool names_only, uint64_t &n_records) {
+    std::vector<fs::path> paths;
+    std::vector<std::unique_ptr<BgzfWriter>> writers;
+    for (size_t i = 0; i < n_partitions; ++i) {
+        paths.push_back(tmpdir / fs::unique_path(stem + "_%%%%_%%%%.records"));
+        writers.push_back(open_spill(paths.back(), compression_level));
+    }
+    BamRecordView read;
+    uint64_t ordinal = 0;
+    for (; reader.GetNextRecordView(read); ++ordinal) {
+        uint64_t fingerprint = name_fingerprint(read.Name(), read.NameLength());
+        auto &writer = *writers[name_partition(fingerprint, n_partitions)];
+        if (names_only) write_entry(writer, ordinal, read.Name(), read.NameLength());
+        else write_entry(writer, ordinal, read.Data(), read.Size());
+    }
+    n_records = ordinal;
+    for (auto &writer : writers) {
+        writer->Close();
+    }
+    return paths;
+}
+
+// Writes the records of subject whose ordinals are set in selected to
+// writer, stopping after the last of n_selected
+static void write_selected(const fs::path &subject, const ReaderOptions &input_options,
+                           const std::vector<uint64_t> &selected, int n_selected, ClosingBamWriter &writer) {
+    ClosingBamReader reader(subject, input_options);
+    BamRecordView read;
+    for (uint64_t ordinal = 0; n_selected > 0 && reader.GetNextRecordView(read); ++ordinal) {
+        if (selected[ordinal >> 6] >> (ordinal & 63) & 1) {
+            writer.SaveRecord(read);
+            n_selected--;
+        }
+    }
+}
+
+// If the query names fit in one batch of at_a_time, subject is read once and
+// matches are written straight to outfile. Otherwise both files are hash
+// partitioned on disk by read name (a Grace join): one pass over each file
+// splits them up, and each partition's names are then joined against its
+// records, at_a_time names at a time should a partition be larger than
+// estimated. Matches are marked in a bitmap of subject ordinals, one bit a
+// record, and a final pass over subject writes them in its order. Either way
+// the inputs are read a fixed number of times, however large the query.
+int filter_bam(fs::path query, fs::path subject, fs::path tmpdir, fs::path outfile, const FilterOptions &options,
+               const ReaderOptions &input_options, const WriterOptions &output_options, const WriterOptions &tmp_options) {
     std::cout << "[filter_bam] - filtering " << subject.string()
               << " for reads with mates in " << query.string()
               << std::endl;
-    std::vector<fs::path> tmpfiles;
+    size_t batch_size = size_t(std::max(options.at_a_time, 1));
+    int written = 0;
 
-    ClosingBamReader query_reader(query);
-    std::unordered_set<std::string> cache;
+    ClosingBamReader query_reader(query, input_options);
+    ClosingBamReader subject_reader(subject, input_options);
+    ClosingBamWriter writer(outfile, subject_reader.GetConstSamHeader(), subject_reader.GetReferenceData(),
+                            output_options);
+    // Names are sharded for the threads to join them in memory, should they all fit
+    NameSet names(options.exact_names, size_t(std::max(options.threads, 1)));
+    bool more = true;
+    if (options.memory_budget > 0) {
+        // Judge the name lengths from a sample, then fill out the batch
+        more = load_names(query_reader, names, BUDGET_SAMPLE_NAMES);
+        batch_size = std::max(names.BatchSize(options.memory_budget), names.Size());
+        std::cout << "[filter_bam] - holding up to " << batch_size << " names in "
+                  << options.memory_budget / 1048576.0 << " MB" << std::endl;
+    }
+    if (!more || !load_names(query_reader, names, batch_size - names.Size())) {
+        names.Seal();
+        std::cout << "[filter_bam] - joining " << names.Size() << " reads in memory" << std::endl;
+        written = join_names(names, subject_reader, writer);
+        std::cout << "[filter_bam] - wrote " << written << " filtered reads" << std::endl;
+        return written;
+    }
 
-    int batch = 1;
-    int written = 0;
-    BamAlignment query_read;
-    while (query_reader.GetNextAlignment(query_read)) {
-        int nreads = 1; // already read one read
-        cache.insert(query_read.Name);
+    // Size partitions to hold about one worker's batch each, judging by how
+    // much of the query file the first batch took up
+    uint64_t consumed = std::max<uint64_t>(query_reader.Tell() >> 16, 1);
+    uint64_t query_size = fs::file_size(query);
+    size_t n_partitions = std::min<size_t>(MAX_PARTITIONS,
+                                           size_t(query_size * 5 * std::max(options.threads, 1) / (consumed * 4)) + 2);
+    std::cout << "[filter_bam] - partitioning reads into " << n_partitions << " buckets" << std::endl;
 
-        while (nreads < at_a_time && query_reader.GetNextAlignment(query_read)) {
-            nreads++;
-            cache.insert(query_read.Name);
-        }
+    auto stem = subject.stem().string();
+    auto name_files = partition_names(query_reader, names, tmpdir, stem, n_partitions, tmp_options.compression_level);
+    names.Clear();
+    query_reader.Close();
+    // To keep subject order, partitions only need names: matches are marked
+    // by ordinal, and picked out of subject in a last pass
+    uint64_t n_records = 0;
+    auto record_files = partition_records(subject_reader, tmpdir, stem, n_partitions, tmp_options.compression_level,
+                                          options.preserve_order, n_records);
+    subject_reader.Close();
+    std::vector<uint64_t> selected(options.preserve_order ? (n_records + 63) / 64 : 0, 0);
 
-        std::cout << "[filter_bam] - batch number " << batch
-                  << " processing " << cache.size() << " reads"
-                  << std::endl;
+    // Each worker joins whole partitions, taking the next until none are
+    // left, with its share of the batch size. Matches go to the bitmap in
+    // one go at the end of a partition, or straight to the output.
+    const size_t n_workers = size_t(std::max(options.threads, 1));
+    const size_t worker_batch = std::max<size_t>(batch_size / n_workers, 1);
+    std::atomic<size_t> next_partition(0);
+    std::mutex output_mutex; // guards selected and writer
+    auto join_partitions = [&]() {
+        NameSet worker_names(options.exact_names);
+        std::vector<uint64_t> matches;
+        int joined = 0;
+        for (size_t i = next_partition++; i < n_partitions; i = next_partition++) {
+            BgzfReader name_reader(name_files[i].string());
+            while (worker_names.Load(name_reader, worker_batch) > 0) {
+                worker_names.Seal();
+                EntryReader records(record_files[i], options.preserve_order);
+                while (!worker_names.Empty() && records.Next()) {
+                    if (worker_names.Erase(records.name, records.name_length,
+                                           name_fingerprint(records.name, records.name_length))) {
+                        if (options.preserve_order) {
+                            matches.push_back(records.ordinal);
+                        }
+                        else {
+                            std::lock_guard<std::mutex> lock(output_mutex);
+                            writer.SaveRecord(records.record);
+                        }
+                        joined++;
+                    }
+                }
+                worker_names.Clear();
+            }
+            name_reader.Close();
+            fs::remove(name_files[i]);
+            fs::remove(record_files[i]);
+            std::lock_guard<std::mutex> lock(output_mutex);
+            for (auto ordinal : matches) {
+                selected[ordinal >> 6] |= uint64_t(1) << (ordinal & 63);
+            }
+            matches.clear();
+        }
+        return joined;
+    };
+    std::vector<std::future<int>> workers;
+    for (size_t i = 1; i < n_workers; ++i) {
+        workers.push_back(std::async(std::launch::async, join_partitions));
+    }
+    written += join_partitions();
+    for (auto &worker : workers) {
+        written += worker.get();
+    }
 
-        // Open subject file
-        ClosingBamReader subject_reader(subject);
+    if (options.preserve_order) {
+        std::cout << "[filter_bam] - writing matches in subject order" << std::endl;
+        write_selected(subject, input_options, selected, written, writer);
+    }
+    std::cout << "[filter_bam] - wrote " << written << " filtered reads" << std::endl;
+    return written;
+}
 
-        // Open writer for this iteration
-        auto stem = subject.stem().string();
-        fs::path tmpfilename = tmpdir / fs::unique_path(stem + "_%%%%_%%%%.bam");
-        tmpfiles.push_back(tmpfilename);
-        ClosingBamWriter batch_writer(tmpfilename, subject_reader.GetConstSamHeader(),
-                                      subject_reader.GetReferenceData());
+// Records of one input waiting for their mate to turn up in the other. They
+// sit in a slab, reusing the slots of those taken out, and a FlatHashSet of
+// slab slots finds them by name.
+class PendingRecords {
+public:
+    PendingRecords() : slots(Hash{&fingerprints}, Equal{&records}) {}
+    PendingRecords(const PendingRecords &) = delete;
+    PendingRecords & operator=(const PendingRecords &) = delete;
 
-        BamAlignment subject_read;
-        while(subject_reader.GetNextAlignment(subject_read)) {
-            auto search = cache.find(subject_read.Name);
-            if (search != cache.end()) {
-                batch_writer.SaveAlignment(subject_read);
-                cache.erase(search);
+    // Adds read, unless a read of the same name is already waiting
+    void Add(const BamRecordView &read, uint64_t fingerprint) {
+        slots.Insert(Lookup{read.Name(), read.NameLength(), fingerprint}, [&]() {
+            uint32_t slot;
+            if (free.empty()) {
+                slot = uint32_t(records.size());
+                records.emplace_back();
+                fingerprints.push_back(0);
+            }
+            else {
+                slot = free.back();
+                free.pop_back();
             }
+            records[slot].Assign(read);
+            fingerprints[slot] = fingerprint;
+            bytes += read.Size();
+            return slot;
+        });
+    }
+
+    // Moves the read named name into mate and removes it, if there is one
+    bool Take(const char *name, size_t length, uint64_t fingerprint, BamRecord &mate) {
+        uint32_t slot = 0;
+        if (!slots.Erase(Lookup{name, length, fingerprint}, [&slot](uint32_t removed) { slot = removed; })) {
+            return false;
         }
+        bytes -= records[slot].Size();
+        std::swap(mate.data, records[slot].data);
+        records[slot].data.clear();
+        free.push_back(slot);
+        return true;
+    }
 
-        // Cleanup
-        cache.clear();
-        batch++;
+    // Bytes of record data held, plus the slab and table's overhead per record
+    size_t Bytes() const {
+        return bytes + records.size() * (sizeof(BamRecord) + sizeof(uint64_t) + 2 * sizeof(uint32_t));
     }
 
-    std::cout << "[filter_bam] - combining tmp bam files" << std::endl;
-    {
-        ClosingBamMultiReader multireader(tmpfiles);
-        ClosingBamWriter writer(outfile, multireader.GetHeader(), multireader.GetReferenceData());
+    bool Empty() const { return slots.Empty(); }
+
+private:
+    struct Lookup {
+        const char *name;
+        size_t length;
+        uint64_t fingerprint;
+    };
 
-        BamAlignment multiread;
-        while (multireader.GetNextAlignment(multiread)) {
-            written++;
-            writer.SaveAlignment(multiread);
+    struct Hash {
+        const std::vector<uint64_t> *fingerprints;
+        uint64_t operator()(uint32_t slot) const { return (*fingerprints)[slot]; }
+        uint64_t operator()(const Lookup &lookup) const { return lookup.fingerprint; }
+    };
+
+    struct Equal {
+        const std::vector<BamRecord> *records;
+        bool operator()(uint32_t slot, const Lookup &lookup) const {
+            const BamRecord &record = (*records)[slot];
+            return record.NameLength() == lookup.length
+                   && std::memcmp(record.Name(), lookup.name, lookup.length) == 0;
+        }
+    };
+
+    std::vector<BamRecord> records;
+    std::vector<uint64_t> fingerprints;
+    std::vector<uint32_t> free;
+    FlatHashSet<uint32_t, Hash, Equal> slots;
+    size_t bytes = 0;
+};
+
+// Bytes of reads pair_mates may hold waiting for mates, without a memory budget
+static const size_t DEFAULT_PENDING_BYTES = size_t(256) << 20;
+
+// Reads the two inputs in step, a read from each in turn. A read whose mate
+// is waiting from the other input is written out with it, and otherwise
+// waits in turn. Inputs written in the same pass over a BAM have pairs in
+// much the same order, so only reads without a mate, and those a little
+// ahead of theirs, are held at any one time. Should that outgrow the budget,
+// each input is filtered against the other instead.
+int pair_mates(fs::path first, fs::path second, fs::path tmpdir, fs::path first_out, fs::path second_out,
+               const FilterOptions &options, const ReaderOptions &input_options,
+               const WriterOptions &output_options, const WriterOptions &tmp_options) {
+    std::cout << "[pair_mates] - pairing reads in " << first.string()
+              << " with mates in " << second.string()
+              << std::endl;
+    const size_t limit = options.memory_budget > 0 ? options.memory_budget : DEFAULT_PENDING_BYTES;
+    int written = 0;
+    bool overflowed = false;
+    {
+        ClosingBamReader first_reader(first, input_options);
+        ClosingBamReader second_reader(second, input_options);
+        ClosingBamWriter first_writer(first_out, first_reader.GetConstSamHeader(), first_reader.GetReferenceData(),
+                                      output_options);
+        ClosingBamWriter second_writer(second_out, second_reader.GetConstSamHeader(),
+                                       second_reader.GetReferenceData(), output_options);
+        ClosingBamReader *readers[2] = {&first_reader, &second_reader};
+        ClosingBamWriter *writers[2] = {&first_writer, &second_writer};
+        PendingRecords pending[2];
+        bool more[2] = {true, true};
+        BamRecordView read;
+        BamRecord mate;
+        for (size_t side = 0; more[0] || more[1]; side = 1 - side) {
+            size_t other = 1 - side;
+            if (!more[side]) continue;
+            if (!readers[side]->GetNextRecordView(read)) {
+                more[side] = false;
+                continue;
+            }
+            uint64_t fingerprint = name_fingerprint(read.Name(), read.NameLength());
+            if (pending[other].Take(read.Name(), read.NameLength(), fingerprint, mate)) {
+                writers[side]->SaveRecord(read);
+                writers[other]->SaveRecord(mate);
+                written += 2;
+            }
+            else if (more[other]) {
+                pending[side].Add(read, fingerprint);
+                if (pending[0].Bytes() + pending[1].Bytes() > limit) {
+                    overflowed = true;
+                    break;
+                }
+            }
+            else if (pending[other].Empty()) {
+                break; // Nothing left for the rest of this input to pair with
+            }
         }
     }
-    for (auto &path : tmpfiles) {
-        remove(path);
-        fs::remove(path.string() + ".bai");
+
+    if (overflowed) {
+        std::cout << "[pair_mates] - inputs too far out of step to pair in memory,"
+                  << " filtering each against the other" << std::endl;
+        FilterOptions half(options);
+        half.memory_budget /= 2;
+        auto second_written = std::async(std::launch::async, filter_bam, first, second, tmpdir, second_out, half,
+                                         input_options, output_options, tmp_options);
+        written = filter_bam(second, first, tmpdir, first_out, half, input_options, output_options, tmp_options);
+        written += second_written.get();
     }
-    std::cout << "[filter_bam] - wrote " << written << " filtered reads" << std::endl;
+    std::cout << "[pair_mates] - wrote " << written << " paired reads" << std::endl;
     return written;
-}
\ No newline at end of file
+}
@@ -2,11 +2,48 @@
 // Created by Kevin Gori on 25/02/2017.
 //
 #include <boost/filesystem.hpp>
+#include "BamfileIO.h"
 
 #ifndef _UTILS_H
 #define _UTILS_H
 
+bool concatenate_bam(const std::vector<boost::filesystem::path> &inputs, boost::filesystem::path outfile,
+                     const WriterOptions &options=WriterOptions());
+
+struct FilterOptions {
+    FilterOptions(int at_a_time = 1000000, bool preserve_order = true, bool exact_names = false,
+                  size_t memory_budget = 0, int threads = 1)
+            : at_a_time(at_a_time), preserve_order(preserve_order), exact_names(exact_names),
+              memory_budget(memory_budget), threads(threads) {}
+    int at_a_time;        // query names held in memory at once, without a memory budget
+    bool preserve_order;  // false lets partitioned matches come out in any order
+    bool exact_names;     // hold whole names rather than 64-bit fingerprints
+    size_t memory_budget; // bytes for the names held at once (0 to go by at_a_time)
+    int threads;          // workers joining shards or partitions, sharing the names held at once
+};
+
+// Writes the first read of subject for each read name in query to outfile,
+// holding at most at_a_time names in memory, or as many as fit in
+// memory_budget, going by the first names read. Larger queries are joined
+// partition by partition through temporary files in tmpdir, and the matches
+// then picked out in a last pass over subject, unless preserve_order is false.
+// With threads > 1, the names held in memory are split into shards, each
+// looked up by a thread of its own, and partitions are joined concurrently.
 int filter_bam(boost::filesystem::path query, boost::filesystem::path subject, boost::filesystem::path tmpdir,
-                boost::filesystem::path outfile, int at_a_time=1000000);
+               boost::filesystem::path outfile, const FilterOptions &options=FilterOptions(),
+               const ReaderOptions &input_options=ReaderOptions(),
+               const WriterOptions &output_options=WriterOptions(),
+               const WriterOptions &tmp_options=WriterOptions());
+
+// Writes the first read of first and of second for each read name found in
+// both to first_out and second_out, in no particular order: the same as
+// filter_bam of second against first and first against second, but reading
+// each input once. Returns the number of reads written to both.
+int pair_mates(boost::filesystem::path first, boost::filesystem::path second, boost::filesystem::path tmpdir,
+               boost::filesystem::path first_out, boost::filesystem::path second_out,
+               const FilterOptions &options=FilterOptions(),
+               const ReaderOptions &input_options=ReaderOptions(),
+               const WriterOptions &output_options=WriterOptions(),
+               const WriterOptions &tmp_options=WriterOptions());
 
 #endif //_UTILS_H
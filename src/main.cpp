@@ -1,7 +1,12 @@
 #include <iostream>
 #include <boost/program_options.hpp>
 #include "BamfileIO.h"
+#include "DeflateCodec.h"
+#include "HalfMappedStream.h"
+#include "MateWindow.h"
+#include "NameCodec.h"
 #include "PileupUtils.h"
+#include "RecordPipe.h"
 #include "Utils.h"
 #include <future>
 #include <iomanip>
@@ -50,6 +55,7 @@ struct FilePaths {
         tmp_unmapped = working_dir / fs::path("tmp_unmapped.bam");
         tmp_both_1 = working_dir / fs::path("tmp_both_1.bam");
         tmp_both_2 = working_dir / fs::path("tmp_both_2.bam");
+        tmp_both_paired = working_dir / fs::path("tmp_both_paired.bam");
         tmp_both_1_filtered = working_dir / fs::path("tmp_both_1_filtered.bam");
         tmp_both_2_filtered = working_dir / fs::path("tmp_both_2_filtered.bam");
 
@@ -108,6 +114,7 @@ struct FilePaths {
     fs::path tmp_unmapped;
     fs::path tmp_both_1;
     fs::path tmp_both_2;
+    fs::path tmp_both_paired;
     fs::path tmp_both_1_filtered;
     fs::path tmp_both_2_filtered;
 
@@ -124,6 +131,16 @@ std::string time_now() {
     return ss.str();
 }
 
+template <typename Type>
+void log_warning_max(Type &variable, const std::string &variable_name, const Type maxval) {
+    if (variable > maxval) {
+        variable = maxval;
+        std::cerr << "[" << time_now() << "] "
+                  << "Warning - value of " << variable_name << " set to maximum of "
+                  << maxval << std::endl;
+    }
+}
+
 template <typename Type>
 void log_warning(Type &variable, const std::string &variable_name, const Type minval) {
     if (variable < minval) {
@@ -135,69 +152,143 @@ void log_warning(Type &variable, const std::string &variable_name, const Type mi
 }
 
 unsigned long write_overlaps(const fs::path &infile, const fs::path &outfile,
-                             const std::vector<Region> &regions) {
+                             const std::vector<Region> &regions,
+                             const ReaderOptions &input_options = ReaderOptions(),
+                             const WriterOptions &options = WriterOptions()) {
     if (regions.empty()) {
         return 0;
     }
     unsigned long nreads = 0;
-    ClosingBamReader reader(infile);
+    ClosingBamReader reader(infile, input_options);
     size_t i = 0;
     auto region = regions[i];
 
-    ClosingBamWriter writer(outfile, reader.GetConstSamHeader(), reader.GetReferenceData());
+    ClosingBamWriter writer(outfile, reader.GetConstSamHeader(), reader.GetReferenceData(), options);
 //    std::cout << "[write_overlaps] writing to " << writer.GetFilename() << std::endl;
-    BamAlignment read;
-    while (reader.GetNextAlignmentCore(read)) {
+    BamRecordView read;
+    while (reader.GetNextRecordView(read)) {
         if (region.overlaps(read)) {
-            writer.SaveAlignment(read);
+            writer.SaveRecord(read);
             nreads++;
         }
         else if (region.fullyLeftOf(read)) {
             i++;
-            if (i > regions.size()) break;
+            if (i >= regions.size()) break;
             region = regions[i];
         }
     }
     return nreads;
 }
 
-bool passes_initial_checks(const BamAlignment &r) {
+bool passes_initial_checks(const BamRecordView &r) {
     return (!r.IsDuplicate() &&
             r.IsPaired() &&
             !r.IsProperPair() &&
             !r.IsFailedQC() &&
-            (r.AlignmentFlag & 0x0800) == 0 &&
+            (r.AlignmentFlag() & 0x0800) == 0 &&
             r.IsPrimaryAlignment() &&
             (!r.IsMapped() || !r.IsMateMapped()));
 }
 
-double avg_base_quality(const BamAlignment &r) {
+double avg_base_quality(const BamRecordView &r) {
+    const uint8_t *qualities = r.Qualities();
+    if (r.Length() > 0 && qualities[0] == 0xff) {
+        return -1; // qualities are missing
+    }
     double totalqual = 0;
-    for (auto basequal : r.Qualities) {
-        totalqual += basequal - 33;
+    for (int32_t i = 0; i < r.Length(); ++i) {
+        totalqual += qualities[i];
     }
-    return totalqual / r.Qualities.length();
+    return totalqual / r.Length();
 }
 
-bool passes_quality_checks(const BamAlignment &r, int base_qual, int map_qual) {
-    return r.IsMapped() ? r.MapQuality >= map_qual : avg_base_quality(r) >= base_qual;
+bool passes_quality_checks(const BamRecordView &r, int base_qual, int map_qual) {
+    return r.IsMapped() ? r.MapQuality() >= map_qual : avg_base_quality(r) >= base_qual;
 }
 
+void check_results(const std::vector<Region> &regions) {
+    if (regions.empty()) {
+        std::stringstream msg;
+        msg << "[" << time_now() << "] "
+                  << "Error - No qualifying reads were found.";
+        throw NoResultsException(msg.str());
+    }
+}
+
+// Half-mapped reads go to stream, if given, rather than to temporaries for pairing up later.
+// Both-unmapped reads are paired with mates written close by as they're read, and the
+// rest left in temporaries; n_both_paired is set to the number paired. With collated
+// given, all the reads with an unmapped mate go to it instead, to be paired by name.
+// With pipeline_depth > 0 each of these outputs takes its reads on a thread of its own,
+// through a RecordPipe of that many batches, while this one reads and classifies them.
 unsigned long initial_extraction(ClosingBamReader &reader, const FilePaths &paths, int base_qual,
-                        int map_qual, bool write_filtered = false, int update_freq = 1000000)
+                        int map_qual, const WriterOptions &tmp_options,
+                        const WriterOptions &output_options, unsigned long &n_both_paired,
+                        bool write_filtered = false, HalfMappedStream *stream = nullptr,
+                        CollatedMates *collated = nullptr, int pipeline_depth = 0, int update_freq = 1000000)
 {
     update_freq = update_freq < 1000 ? 1000 : update_freq;
 
     auto header = reader.GetConstSamHeader();
     auto references = reader.GetReferenceData();
 
-    ClosingBamWriter tmp_mapped_writer(paths.tmp_mapped, header, references);
-    ClosingBamWriter tmp_unmapped_writer(paths.tmp_unmapped, header, references);
-    ClosingBamWriter tmp_both_1_writer(paths.tmp_both_1, header, references);
-    ClosingBamWriter tmp_both_2_writer(paths.tmp_both_2, header, references);
+    std::unique_ptr<ClosingBamWriter> tmp_mapped_writer;
+    std::unique_ptr<ClosingBamWriter> tmp_unmapped_writer;
+    if (!stream && !collated) {
+        tmp_mapped_writer = std::make_unique<ClosingBamWriter>(paths.tmp_mapped, header, references, tmp_options);
+        tmp_unmapped_writer = std::make_unique<ClosingBamWriter>(paths.tmp_unmapped, header, references, tmp_options);
+    }
+    std::unique_ptr<ClosingBamWriter> tmp_both_1_writer;
+    std::unique_ptr<ClosingBamWriter> tmp_both_2_writer;
+    std::unique_ptr<ClosingBamWriter> tmp_both_paired_writer;
+    std::unique_ptr<MateWindow> both_unmapped;
+    if (!collated) {
+        tmp_both_1_writer = std::make_unique<ClosingBamWriter>(paths.tmp_both_1, header, references, tmp_options);
+        tmp_both_2_writer = std::make_unique<ClosingBamWriter>(paths.tmp_both_2, header, references, tmp_options);
+        // Paired reads are copied unchanged into the both-unmapped output, so they're compressed for it
+        WriterOptions paired_options(output_options);
+        paired_options.build_index = false;
+        tmp_both_paired_writer = std::make_unique<ClosingBamWriter>(paths.tmp_both_paired, header, references,
+                                                                    paired_options);
+        both_unmapped = std::make_unique<MateWindow>(*tmp_both_paired_writer, *tmp_both_1_writer,
+                                                     *tmp_both_2_writer);
+    }
     std::unique_ptr<ClosingBamWriter> filtered_writer;
     if (write_filtered) {
-        filtered_writer = std::make_unique<ClosingBamWriter>(paths.filtered, header, references);
+        filtered_writer = std::make_unique<ClosingBamWriter>(paths.filtered, header, references, output_options);
+    }
+
+    // Each output is a function taking its reads, called here or at the end of a pipe.
+    // The pipes are declared after what they write to, so they're stopped first.
+    typedef std::function<void(const BamRecordView &)> Output;
+    std::vector<std::unique_ptr<RecordPipe>> pipes;
+    auto output = [&pipes, pipeline_depth](Output consume) {
+        if (pipeline_depth <= 0) return consume;
+        pipes.push_back(std::make_unique<RecordPipe>(std::move(consume), size_t(pipeline_depth)));
+        RecordPipe *pipe = pipes.back().get();
+        return Output([pipe](const BamRecordView &read) { pipe->Add(read); });
+    };
+    Output save_filtered, save_collated, save_both, save_mapped, save_unmapped;
+    if (filtered_writer) {
+        save_filtered = output([&filtered_writer](const BamRecordView &read) { filtered_writer->SaveRecord(read); });
+    }
+    if (collated) {
+        save_collated = output([collated](const BamRecordView &read) { collated->Add(read); });
+    }
+    else {
+        save_both = output([&both_unmapped](const BamRecordView &read) { both_unmapped->Add(read); });
+    }
+    if (stream) {
+        // Both halves go down the same pipe, as the stream pairs them in input order
+        save_mapped = save_unmapped = output([stream](const BamRecordView &read) { stream->Add(read); });
+    }
+    else if (!collated) {
+        save_mapped = output([&tmp_mapped_writer](const BamRecordView &read) {
+            tmp_mapped_writer->SaveRecord(read);
+        });
+        save_unmapped = output([&tmp_unmapped_writer](const BamRecordView &read) {
+            tmp_unmapped_writer->SaveRecord(read);
+        });
     }
 
 
@@ -207,8 +298,8 @@ unsigned long initial_extraction(ClosingBamReader &reader, const FilePaths &path
     unsigned long nreads = 0;
     unsigned long nfiltered = 0;
 
-    BamAlignment read;
-    while (reader.GetNextAlignmentCore(read)) {
+    BamRecordView read;
+    while (reader.GetNextRecordView(read)) {
         nreads++;
         if (nreads % update_freq == 0) {
             std::cout << "Read " << nreads << " reads\r";
@@ -222,42 +313,177 @@ unsigned long initial_extraction(ClosingBamReader &reader, const FilePaths &path
 
         if (passes_initial_checks(read)) {
             nfiltered++;
-            read.BuildCharData();
             if (write_filtered && filtered_writer) {
-                filtered_writer->SaveAlignment(read);
+                save_filtered(read);
             }
 
             if (passes_quality_checks(read, base_qual, map_qual)) { // At least one of pair is unmapped
-                if (!read.IsMapped()) { // Current read is unmapped
+                if (collated) {
+                    save_collated(read);
+                }
+                else if (!read.IsMapped()) { // Current read is unmapped
                     if (!read.IsMateMapped()) { // Mate is unmapped
-                        if (read.IsFirstMate()) { // Both unmapped, first in pair
-                            tmp_both_1_writer.SaveAlignment(read);
-                        }
-                        else { // Both unmapped, second in pair
-                            tmp_both_2_writer.SaveAlignment(read);
-                        }
+                        save_both(read);
                     } else { // Current read unmapped, mate is mapped
-                        tmp_unmapped_writer.SaveAlignment(read);
+                        save_unmapped(read);
                     }
                 } else { // Current read is mapped, mate is unmapped
                     assert (!read.IsMateMapped());
-                    tmp_mapped_writer.SaveAlignment(read);
+                    save_mapped(read);
                 }
             }
         }
     }
+    for (auto &pipe : pipes) {
+        pipe->Close();
+    }
     std::cout << "\n[initial_extraction] [" << time_now() << "]"
               << " Finished. Found " << nfiltered << " unmapped reads"
               << std::endl;
+    if (collated) {
+        collated->Finish();
+        n_both_paired = collated->BothWritten();
+    }
+    else {
+        both_unmapped->Finish();
+        n_both_paired = both_unmapped->PairedWritten();
+        std::cout << "[initial_extraction] Paired " << n_both_paired << " both-unmapped reads with mates close by, "
+                  << both_unmapped->UnpairedWritten() << " left to pair" << std::endl;
+    }
     return nfiltered;
 }
 
+// Steps 1-5 in a single pass of a coordinate-sorted input, pairing each
+// unmapped read with a mapped mate at the position it's placed at. Returns
+// false if a read isn't placed with its mate, and the input must be read again.
+bool stream_extraction(const FilePaths &paths, int base_qual, int map_qual, int min_coverage,
+                       const ReaderOptions &input_options, const WriterOptions &tmp_options,
+                       const WriterOptions &output_options, bool write_filtered, int pipeline_depth,
+                       unsigned long &nfiltered, unsigned long &n_both_paired, unsigned long &n_halfmapped,
+                       unsigned long &n_halfunmapped)
+{
+    ClosingBamReader reader(paths.inputfile, input_options);
+    ClosingBamWriter mapped_writer(paths.halfmapped, reader.GetConstSamHeader(), reader.GetReferenceData(),
+                                   output_options);
+    ClosingBamWriter unmapped_writer(paths.halfunmapped, reader.GetConstSamHeader(), reader.GetReferenceData(),
+                                     output_options);
+    HalfMappedStream stream(mapped_writer, unmapped_writer, min_coverage);
+    std::cout << "[stream_extraction] Pairing half-mapped reads and checking their coverage as they're read"
+              << std::endl;
+    try {
+        nfiltered = initial_extraction(reader, paths, base_qual, map_qual, tmp_options, output_options,
+                                       n_both_paired, write_filtered, &stream, nullptr, pipeline_depth);
+    }
+    catch (StreamOrderException &e) {
+        std::cout << "\n[stream_extraction] [" << time_now() << "] " << e.what()
+                  << ", so half-mapped reads will be paired in separate passes" << std::endl;
+        // The separate passes write the outputs afresh, and may stop before they get to them
+        mapped_writer.Close();
+        unmapped_writer.Close();
+        for (const auto &output : {paths.halfmapped, paths.halfunmapped}) {
+            fs::remove(output);
+            fs::remove(output.string() + ".bai");
+        }
+        return false;
+    }
+    stream.Finish();
+    check_results(stream.Regions());
+    n_halfmapped = stream.MappedWritten();
+    n_halfunmapped = stream.UnmappedWritten();
+    return true;
+}
+
+// Steps 1-6 in a single pass of input collated by read name, such as name-sorted
+// input, where the reads of each pair are next to each other. Half-mapped pairs
+// are put in coordinate order for their coverage to be checked, in memory_budget
+// bytes (or a default), beyond which sorted runs of them are written to the working dir.
+// With collate, for input in any other order, the reads are first collated by name,
+// through buckets in the working dir should they not fit in memory_budget. Returns
+// false if input said to be collated isn't, and must be collated after all.
+bool collated_extraction(const FilePaths &paths, int base_qual, int map_qual, int min_coverage,
+                         const ReaderOptions &input_options, const WriterOptions &tmp_options,
+                         const WriterOptions &output_options, bool write_filtered, int pipeline_depth,
+                         size_t memory_budget, bool collate, unsigned long &nfiltered, unsigned long &n_both_unmapped,
+                         unsigned long &n_halfmapped, unsigned long &n_halfunmapped)
+{
+    ClosingBamReader reader(paths.inputfile, input_options);
+    const SamHeader &header = reader.GetConstSamHeader();
+    const RefVector &references = reader.GetReferenceData();
+    // The half-mapped outputs are written in coordinate order, whatever the input's
+    SamHeader sorted_header(header);
+    if (!sorted_header.HasVersion()) sorted_header.Version = "1.4";
+    sorted_header.SortOrder = "coordinate";
+    sorted_header.GroupOrder.clear();
+    ClosingBamWriter mapped_writer(paths.halfmapped, sorted_header, references, output_options);
+    ClosingBamWriter unmapped_writer(paths.halfunmapped, sorted_header, references, output_options);
+    // The both-unmapped reads are all unplaced, so there's nothing to index
+    WriterOptions both_options(output_options);
+    both_options.build_index = false;
+    ClosingBamWriter both_writer(paths.bothunmapped, header, references, both_options);
+
+    std::unique_ptr<HalfMappedSorter> sorter;
+    std::unique_ptr<CollatedMates> mates;
+    if (collate) {
+        // The budget is split between the reads being collated and the half-mapped pairs found
+        // among them. Buckets are sized to fit it were every read in the input to be collated.
+        size_t budget = (memory_budget > 0 ? memory_budget : DEFAULT_SORT_BYTES) / 2;
+        uintmax_t input_size = fs::file_size(paths.inputfile);
+        size_t n_buckets = size_t(std::min<uintmax_t>(MAX_BUCKETS, input_size * 4 / budget + 1));
+        sorter = std::make_unique<HalfMappedSorter>(paths.working_dir, header, references, budget, tmp_options);
+        mates = std::make_unique<BucketedMates>(both_writer, *sorter, paths.working_dir, header, references, budget,
+                                                n_buckets, input_options, tmp_options);
+        std::cout << "[collated_extraction] Collating reads by name to pair them with their mates" << std::endl;
+    }
+    else {
+        sorter = std::make_unique<HalfMappedSorter>(paths.working_dir, header, references, memory_budget,
+                                                    tmp_options);
+        mates = std::make_unique<CollatedMates>(both_writer, *sorter);
+        std::cout << "[collated_extraction] Pairing reads with the mates next to them" << std::endl;
+    }
+    try {
+        nfiltered = initial_extraction(reader, paths, base_qual, map_qual, tmp_options, output_options,
+                                       n_both_unmapped, write_filtered, nullptr, mates.get(), pipeline_depth);
+    }
+    catch (CollationOrderException &e) {
+        std::cout << "\n[collated_extraction] [" << time_now() << "] " << e.what()
+                  << ", so reads will be collated by name first" << std::endl;
+        return false;
+    }
+
+    std::cout << "[collated_extraction] [" << time_now() << "] Checking coverage of half-mapped reads" << std::endl;
+    HalfMappedStream stream(mapped_writer, unmapped_writer, min_coverage);
+    sorter->Finish(stream);
+    stream.Finish();
+    check_results(stream.Regions());
+    n_halfmapped = stream.MappedWritten();
+    n_halfunmapped = stream.UnmappedWritten();
+    return true;
+}
+
+// Order of the reads in a file with header, as its @HD line gives it
+std::string header_input_order(const SamHeader &header) {
+    if (header.SortOrder == "coordinate") return "coordinate";
+    if (header.SortOrder == "queryname" || header.GroupOrder == "query") return "queryname";
+    return "unsorted";
+}
+
 int main(int argc, char** argv) {
 
     // Options
     int MAPQUAL = 30;
     int BASEQUAL = 10;
     int MINCOV = 1;
+    int DECODE_THREADS = 0;
+    bool USE_MMAP = false;
+    bool EXACT_NAMES = false;
+    std::string INPUT_ORDER = "auto";
+    int MEMORY = 0;
+    int FILTER_THREADS = 1;
+    int READ_AHEAD = 0;
+    int ENCODE_THREADS = 0;
+    int PIPELINE_DEPTH = 0;
+    int COMPRESSION = 6;
+    int TMP_COMPRESSION = 1;
     bool delete_wdir = false;
     std::string _working_dir_;
     std::string _input_file_;     // input bam file
@@ -271,6 +497,32 @@ int main(int argc, char** argv) {
     ("mapqual,q", po::value<int>(&MAPQUAL)->default_value(MAPQUAL), "Minimum mapping quality")
     ("basequal,b", po::value<int>(&BASEQUAL)->default_value(BASEQUAL), "Minimum mapping quality")
     ("coverage,c", po::value<int>(&MINCOV)->default_value(MINCOV), "Minimum mapped read coverage")
+    ("decode-threads", po::value<int>(&DECODE_THREADS)->default_value(DECODE_THREADS),
+            "Threads used by each reader to decompress input blocks")
+    ("mmap", po::bool_switch(&USE_MMAP), "Memory-map input files instead of reading them with buffered IO")
+    ("read-ahead", po::value<int>(&READ_AHEAD)->default_value(READ_AHEAD),
+            "Asynchronous block reads kept in flight by each reader (0 reads synchronously; ignored with --mmap)")
+    ("encode-threads", po::value<int>(&ENCODE_THREADS)->default_value(ENCODE_THREADS),
+            "Threads used by each writer to compress output blocks")
+    ("pipeline-depth", po::value<int>(&PIPELINE_DEPTH)->default_value(PIPELINE_DEPTH),
+            "Batches of reads queued for each output of the first pass, which is then written on a thread of its "
+            "own (0 writes them all on the reading thread)")
+    ("compression", po::value<int>(&COMPRESSION)->default_value(COMPRESSION),
+            "Compression level (0-9) of output files")
+    ("tmp-compression", po::value<int>(&TMP_COMPRESSION)->default_value(TMP_COMPRESSION),
+            "Compression level (0-9) of temporary files in the working dir")
+    ("exact-names", po::bool_switch(&EXACT_NAMES),
+            "Pair mates by whole read names, rather than 64-bit fingerprints (holds half as many names in memory)")
+    ("memory", po::value<int>(&MEMORY)->default_value(MEMORY),
+            "Memory (MB) for the read names held while pairing mates (0 holds a fixed number of names)")
+    ("filter-threads", po::value<int>(&FILTER_THREADS)->default_value(FILTER_THREADS),
+            "Threads used by each mate-pairing filter to join its reads, each looking up a shard of the names "
+            "held in memory, or taking partitions of them in turn when there are too many to hold")
+    ("input-order", po::value<std::string>(&INPUT_ORDER)->default_value(INPUT_ORDER),
+            "Order of the input reads: coordinate, queryname (or collated by name), unsorted, or auto to go by "
+            "its header. Mates in sorted or collated input are paired as they're read, and unsorted input is "
+            "collated by name first, not in separate passes. Input found out of the order given is read again "
+            "as coordinate input would be in separate passes, or otherwise collated by name")
     ("working-dir,w", po::value<std::string>(&_working_dir_), "Working dir")
     ("delete,d", po::value<bool>(&delete_wdir)->default_value(delete_wdir), "Delete working dir")
     ("input,i", po::value<std::string>(&_input_file_)->required(), "Path to input file")
@@ -296,6 +548,10 @@ int main(int argc, char** argv) {
         }
         po::notify(vm); // throws on error, so do after help in case
         // there are any problems
+        if (INPUT_ORDER != "auto" && INPUT_ORDER != "coordinate" && INPUT_ORDER != "queryname"
+            && INPUT_ORDER != "unsorted") {
+            throw po::validation_error(po::validation_error::invalid_option_value, "input-order", INPUT_ORDER);
+        }
     }
     catch(po::error& e) {
         std::cerr << "ERROR: "
@@ -317,11 +573,52 @@ int main(int argc, char** argv) {
         log_warning(BASEQUAL, "BASEQUAL", 0);
         log_warning(MINCOV, "MINCOV", 1);
         log_warning(MAPQUAL, "MAPQUAL", 0);
+        log_warning(DECODE_THREADS, "DECODE_THREADS", 0);
+        log_warning(READ_AHEAD, "READ_AHEAD", 0);
+        log_warning(MEMORY, "MEMORY", 0);
+        log_warning(FILTER_THREADS, "FILTER_THREADS", 1);
+        log_warning(ENCODE_THREADS, "ENCODE_THREADS", 0);
+        log_warning(PIPELINE_DEPTH, "PIPELINE_DEPTH", 0);
+        log_warning(COMPRESSION, "COMPRESSION", 0);
+        log_warning_max(COMPRESSION, "COMPRESSION", 9);
+        log_warning(TMP_COMPRESSION, "TMP_COMPRESSION", 0);
+        log_warning_max(TMP_COMPRESSION, "TMP_COMPRESSION", 9);
+        const ReaderOptions input_options(DECODE_THREADS, USE_MMAP, READ_AHEAD);
+        const WriterOptions output_options(COMPRESSION, ENCODE_THREADS);
+        const WriterOptions tmp_options(TMP_COMPRESSION, ENCODE_THREADS, false);
+        // Temporaries whose blocks are copied unchanged into a final output
+        const WriterOptions staged_options(COMPRESSION, ENCODE_THREADS, false);
+        // Name tables are kept at most 3/4 full, so a fingerprint takes 8 * 4/3,
+        // about 11 bytes a name, and an Illumina name packed in ExactNameSet a
+        // PackedName and a control byte, (16 + 1) * 4/3, about 23 (other names
+        // take their length on top). Exact batches are smaller to match.
+        const int fingerprints_in_memory = 10000000;
+        const int names_in_memory = EXACT_NAMES
+                ? int(fingerprints_in_memory * sizeof(uint64_t) / (sizeof(PackedName) + 1))
+                : fingerprints_in_memory;
+        // Mapped-read filtering takes a third of the budget while the both-unmapped
+        // reads are paired with the rest, and the last filter has it to itself
+        const size_t memory_budget = size_t(MEMORY) << 20;
+        const FilterOptions ordered_filter(names_in_memory, true, EXACT_NAMES, memory_budget / 3, FILTER_THREADS);
+        const FilterOptions pairing_filter(names_in_memory, false, EXACT_NAMES, memory_budget / 3 * 2, FILTER_THREADS);
+        const FilterOptions final_filter(names_in_memory, true, EXACT_NAMES, memory_budget, FILTER_THREADS);
 
         // Print all option values
         std::cout << "MAPQUAL " << MAPQUAL << std::endl;
         std::cout << "BASEQUAL " << BASEQUAL << std::endl;
         std::cout << "MINCOV " << MINCOV << std::endl;
+        std::cout << "DECODE_THREADS " << DECODE_THREADS << std::endl;
+        std::cout << "USE_MMAP " << (USE_MMAP ? "true" : "false") << std::endl;
+        std::cout << "READ_AHEAD " << READ_AHEAD << std::endl;
+        std::cout << "ENCODE_THREADS " << ENCODE_THREADS << std::endl;
+        std::cout << "PIPELINE_DEPTH " << PIPELINE_DEPTH << std::endl;
+        std::cout << "COMPRESSION " << COMPRESSION << std::endl;
+        std::cout << "TMP_COMPRESSION " << TMP_COMPRESSION << std::endl;
+        std::cout << "EXACT_NAMES " << (EXACT_NAMES ? "true" : "false") << std::endl;
+        std::cout << "MEMORY " << MEMORY << std::endl;
+        std::cout << "FILTER_THREADS " << FILTER_THREADS << std::endl;
+        std::cout << "INPUT_ORDER " << INPUT_ORDER << std::endl;
+        std::cout << "Deflate codec " << DeflateCodec::Name() << std::endl;
         std::cout << "Input file " << fs::system_complete(filepaths.inputfile).string() << std::endl;
         std::cout << "Mapped file " << fs::system_complete(filepaths.halfmapped).string() << std::endl;
         std::cout << "Unmapped file " << fs::system_complete(filepaths.halfunmapped).string() << std::endl;
@@ -330,75 +627,100 @@ int main(int argc, char** argv) {
         std::cout << "Write filtered?: " << (write_filtered ? "true" : "false") << std::endl;
 
 
-        ClosingBamReader reader(filepaths.inputfile);
-        const SamHeader header = reader.GetConstSamHeader();
-        const RefVector references = reader.GetReferenceData();
-
-        // 1: Extract all reads with at least 1 mate unmapped
-        auto nfiltered = initial_extraction(reader, filepaths, BASEQUAL, MAPQUAL, write_filtered);
-
-        // 2: Filter files to pair up mates
-        std::vector<std::future<int>> filter_results;
-        filter_results.push_back(
-                std::async(filter_bam, filepaths.tmp_unmapped, filepaths.tmp_mapped,
-                           filepaths.working_dir, filepaths.tmp_mapped_filtered, 1000000));
-        filter_results.push_back(
-                std::async(filter_bam, filepaths.tmp_both_1, filepaths.tmp_both_2,
-                           filepaths.working_dir, filepaths.tmp_both_2_filtered, 1000000));
-        filter_results.push_back(
-                std::async(filter_bam, filepaths.tmp_both_2, filepaths.tmp_both_1,
-                           filepaths.working_dir, filepaths.tmp_both_1_filtered, 1000000));
-
-        // 3: Pileup and find reads passing minimum coverage threshold
-        std::cout << "Checking coverage of filtered reads" << std::endl;
-        auto visitor = std::make_unique<CoverageVisitor>(MINCOV);
+        // Only the header is needed up front, so it's read without decode threads or read-ahead
+        SamHeader header;
         {
-            PileupEngine pileup(true);
-            pileup.AddVisitor(visitor.get());
-            filter_results[0].get();  // this result needs to be ready now
-            ClosingBamReader pileup_reader(filepaths.tmp_mapped_filtered);
-            pileup_reader.CreateIndex();
-            std::cout << "Piling up " << pileup_reader.GetFilename() << std::endl;
-            BamAlignment read;
-            while (pileup_reader.GetNextAlignmentCore(read)) {
-                pileup.AddAlignment(read);
-            }
-            pileup.Flush();
-        }
-        visitor->Finalise();
-
-        // Quit if no qualifying reads are found
-        if (visitor->regions.empty()) {
-            std::stringstream msg;
-            msg << "[" << time_now() << "] "
-                      << "Error - No qualifying reads were found.";
-            throw NoResultsException(msg.str());
+            ClosingBamReader header_reader(filepaths.inputfile);
+            header = header_reader.GetConstSamHeader();
         }
 
-        // Make sure files are ready
-        for (auto it = std::next(filter_results.begin()); it != filter_results.end(); it++) {
-            (*it).get();
+        // 1: Extract all reads with at least 1 mate unmapped. In input collated by name each read is
+        // next to its mate, so all the steps are done in the same pass, and unsorted input is collated
+        // to do the same. In coordinate-sorted input each half-mapped read is placed with its mate,
+        // so steps 2-5 are done for them in the same pass
+        std::string input_order = INPUT_ORDER == "auto" ? header_input_order(header) : INPUT_ORDER;
+        std::cout << "Input order " << input_order << std::endl;
+        unsigned long nfiltered = 0;
+        unsigned long n_both_unmapped = 0;
+        unsigned long n_halfmapped = 0;
+        unsigned long n_halfunmapped = 0;
+        if (input_order != "coordinate") {
+            bool collated = collated_extraction(filepaths, BASEQUAL, MAPQUAL, MINCOV, input_options, tmp_options,
+                                                output_options, write_filtered, PIPELINE_DEPTH, memory_budget,
+                                                input_order == "unsorted", nfiltered, n_both_unmapped,
+                                                n_halfmapped, n_halfunmapped);
+            if (!collated) {
+                collated_extraction(filepaths, BASEQUAL, MAPQUAL, MINCOV, input_options, tmp_options, output_options,
+                                    write_filtered, PIPELINE_DEPTH, memory_budget, true, nfiltered,
+                                    n_both_unmapped, n_halfmapped, n_halfunmapped);
+            }
         }
+        else {
+            unsigned long n_both_paired = 0;
+            bool streamed = stream_extraction(filepaths, BASEQUAL, MAPQUAL, MINCOV, input_options, tmp_options,
+                                              output_options, write_filtered, PIPELINE_DEPTH, nfiltered,
+                                              n_both_paired, n_halfmapped, n_halfunmapped);
+            if (!streamed) {
+                ClosingBamReader reader(filepaths.inputfile, input_options);
+                nfiltered = initial_extraction(reader, filepaths, BASEQUAL, MAPQUAL, tmp_options,
+                                               output_options, n_both_paired, write_filtered, nullptr, nullptr,
+                                               PIPELINE_DEPTH);
+            }
 
-        // 4: Find mapped reads passing coverage checks to finalise half-mapped
-        auto n_halfmapped = write_overlaps(filepaths.tmp_mapped_filtered, filepaths.halfmapped, visitor->regions);
+            // 2: Filter files to pair up mates (of the both-unmapped reads, those not paired in step 1)
+            auto both_result = std::async(pair_mates, filepaths.tmp_both_1, filepaths.tmp_both_2,
+                                          filepaths.working_dir, filepaths.tmp_both_1_filtered,
+                                          filepaths.tmp_both_2_filtered, pairing_filter, input_options,
+                                          staged_options, staged_options);
+            if (!streamed) {
+                auto mapped_result = std::async(filter_bam, filepaths.tmp_unmapped, filepaths.tmp_mapped,
+                                                filepaths.working_dir, filepaths.tmp_mapped_filtered, ordered_filter,
+                                                input_options, tmp_options, tmp_options);
+
+                // 3: Pileup and find reads passing minimum coverage threshold
+                std::cout << "Checking coverage of filtered reads" << std::endl;
+                auto visitor = std::make_unique<CoverageVisitor>(MINCOV);
+                {
+                    PileupEngine pileup(true);
+                    pileup.AddVisitor(visitor.get());
+                    mapped_result.get();  // this result needs to be ready now
+                    ClosingBamReader pileup_reader(filepaths.tmp_mapped_filtered, input_options);
+                    std::cout << "Piling up " << pileup_reader.GetFilename() << std::endl;
+                    BamAlignment read;
+                    while (pileup_reader.GetNextAlignmentCore(read)) {
+                        pileup.AddAlignment(read);
+                    }
+                    pileup.Flush();
+                }
+                visitor->Finalise();
 
+                // Quit if no qualifying reads are found
+                check_results(visitor->regions);
 
-        // 5: One last filter to finalise half-unmapped
-        auto n_halfunmapped = filter_bam(filepaths.halfmapped, filepaths.tmp_unmapped,
-                   filepaths.working_dir, filepaths.halfunmapped, 1000000);
+                // 4: Find mapped reads passing coverage checks to finalise half-mapped
+                n_halfmapped = write_overlaps(filepaths.tmp_mapped_filtered, filepaths.halfmapped,
+                                              visitor->regions, input_options, output_options);
 
+                // 5: One last filter to finalise half-unmapped, once the both-unmapped reads are
+                // paired, so it has the memory budget to itself
+                n_both_unmapped = n_both_paired + both_result.get();
+                n_halfunmapped = filter_bam(filepaths.halfmapped, filepaths.tmp_unmapped,
+                                            filepaths.working_dir, filepaths.halfunmapped, final_filter,
+                                            input_options, output_options, tmp_options);
+            }
 
-        // 6: Consolidate to finalise both-unmapped
-        std::vector<fs::path> both_mapped_paths{filepaths.tmp_both_1_filtered, filepaths.tmp_both_2_filtered};
-        ClosingBamMultiReader consolidate_unmapped_reader(both_mapped_paths);
-        ClosingBamWriter consolidate_unmapped_writer(filepaths.bothunmapped, consolidate_unmapped_reader.GetHeader(),
-                                                     consolidate_unmapped_reader.GetReferenceData());
-        BamAlignment read;
-        unsigned long n_both_unmapped = 0;
-        while (consolidate_unmapped_reader.GetNextAlignment(read)) {
-            consolidate_unmapped_writer.SaveAlignment(read);
-            n_both_unmapped++;
+            // Make sure files are ready
+            if (both_result.valid()) n_both_unmapped = n_both_paired + both_result.get();
+
+            // 6: Consolidate to finalise both-unmapped. These reads are all unplaced, so
+            // their order doesn't matter and the compressed blocks are copied as they are
+            std::vector<fs::path> both_mapped_paths{filepaths.tmp_both_paired, filepaths.tmp_both_1_filtered,
+                                                    filepaths.tmp_both_2_filtered};
+            if (!concatenate_bam(both_mapped_paths, filepaths.bothunmapped, output_options)) {
+                std::cerr << "[" << time_now() << "] "
+                          << "Error - couldn't combine both-unmapped reads" << std::endl;
+                return 1;
+            }
         }
 
         // Done: Write a message to confirm where the output was written
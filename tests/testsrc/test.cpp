@@ -2,8 +2,20 @@
 // Created by Kevin Gori on 25/02/2017.
 //
 
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
 #include <BamfileIO.h>
 #include "gtest/gtest.h"
+#include "BloomFilter.h"
+#include "DeflateCodec.h"
+#include "FingerprintSet.h"
+#include "HalfMappedStream.h"
+#include "MateWindow.h"
+#include "NameCodec.h"
+#include "RecordPipe.h"
 #include "Utils.h"
 
 namespace fs = boost::filesystem;
@@ -33,4 +45,865 @@ TEST(test, test_filter_bam) {
     ASSERT_STREQ(names[4].c_str(), "SOLEXA-1GA-2_2_FC20EMB:5:165:628:70");
     ASSERT_STREQ(names[5].c_str(), "SOLEXA-1GA-2_2_FC20EMB:5:108:485:455");
     ASSERT_STREQ(names[6].c_str(), "SOLEXA-1GA-2_2_FC20EMB:5:240:501:237");
-}
\ No newline at end of file
+}
+
+TEST(test, test_filter_bam_options) {
+    std::vector<std::vector<std::string>> results;
+    // query.bam has 7 reads, so a batch of 7 holds them all and needs no partitions, with
+    // threads sharing them out
+    for (auto options : {FilterOptions(5), FilterOptions(5, true, true), FilterOptions(2, true, false, 0, 3),
+                         FilterOptions(7), FilterOptions(7, true, false, 0, 3), FilterOptions(7, true, true, 0, 3)}) {
+        testing::internal::CaptureStdout();
+        int written = filter_bam(fs::path("../data/query.bam"),
+                                 fs::path("../data/subject.bam"),
+                                 fs::path("."),
+                                 fs::path("../data/result.bam"),
+                                 options);
+        std::string log = testing::internal::GetCapturedStdout();
+        ASSERT_EQ(written, 7);
+        ASSERT_EQ(log.find("partitioning") == std::string::npos, options.at_a_time == 7);
+        results.emplace_back();
+        ClosingBamReader checker(fs::path("../data/result.bam"));
+        BamTools::BamAlignment read;
+        while (checker.GetNextAlignment(read)) {
+            results.back().push_back(read.Name);
+        }
+        fs::remove(fs::path("../data/result.bam"));
+    }
+    for (const auto &result : results) {
+        ASSERT_EQ(result, results[0]);
+    }
+}
+
+static std::vector<std::string> sorted_names(const fs::path &path) {
+    std::vector<std::string> names;
+    ClosingBamReader checker(path);
+    BamTools::BamAlignment read;
+    while (checker.GetNextAlignment(read)) {
+        names.push_back(read.Name);
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+TEST(test, test_pair_mates) {
+    int expected = filter_bam(fs::path("../data/query.bam"), fs::path("../data/subject.bam"), fs::path("."),
+                              fs::path("../data/expected_2.bam"));
+    expected += filter_bam(fs::path("../data/subject.bam"), fs::path("../data/query.bam"), fs::path("."),
+                           fs::path("../data/expected_1.bam"));
+    // The second budget is too small to hold any reads, so the pairing falls back to filter_bam
+    for (size_t budget : {0, 1}) {
+        int written = pair_mates(fs::path("../data/query.bam"), fs::path("../data/subject.bam"), fs::path("."),
+                                 fs::path("../data/result_1.bam"), fs::path("../data/result_2.bam"),
+                                 FilterOptions(1000000, false, false, budget));
+        ASSERT_EQ(written, expected);
+        ASSERT_EQ(sorted_names("../data/result_1.bam"), sorted_names("../data/expected_1.bam"));
+        ASSERT_EQ(sorted_names("../data/result_2.bam"), sorted_names("../data/expected_2.bam"));
+    }
+    for (auto name : {"expected_1", "expected_2", "result_1", "result_2"}) {
+        fs::remove(fs::path("../data") / (std::string(name) + ".bam"));
+    }
+}
+
+// Synthetic BAMs for a test, with the header of subject.bam, in a temporary dir
+// that's removed with everything in it when the test ends, passing or not
+class TestFiles {
+public:
+    TestFiles() : dir(fs::temp_directory_path() / fs::unique_path("bamreligion_test_%%%%_%%%%")) {
+        fs::create_directories(dir);
+        ClosingBamReader reader(fs::path("../data/subject.bam"));
+        header = reader.GetConstSamHeader();
+        references = reader.GetReferenceData();
+    }
+    ~TestFiles() {
+        boost::system::error_code error;
+        fs::remove_all(dir, error);
+    }
+
+    fs::path Path(const std::string &name) const { return dir / (name + ".bam"); }
+
+    // Opens name.bam for writing, unindexed unless options say otherwise
+    std::unique_ptr<ClosingBamWriter> Writer(const std::string &name,
+                                             const WriterOptions &options = WriterOptions(-1, 0, false)) const {
+        return std::make_unique<ClosingBamWriter>(Path(name), header, references, options);
+    }
+
+    fs::path Write(const std::string &name, const std::vector<BamTools::BamAlignment> &reads) const {
+        auto writer = Writer(name);
+        for (const auto &read : reads) {
+            writer->SaveAlignment(read);
+        }
+        return Path(name);
+    }
+
+    // Files in the dir whose names start with prefix
+    size_t Count(const std::string &prefix) const {
+        size_t n = 0;
+        for (fs::directory_iterator it(dir); it != fs::directory_iterator(); ++it) {
+            if (it->path().filename().string().compare(0, prefix.size(), prefix) == 0) n++;
+        }
+        return n;
+    }
+
+    const fs::path dir;
+    BamTools::SamHeader header;
+    BamTools::RefVector references;
+};
+
+// Names of the reads in path, each followed by what suffix gives for it
+static std::vector<std::string> read_names(const fs::path &path,
+                                           std::function<std::string(const BamTools::BamAlignment &)> suffix) {
+    std::vector<std::string> names;
+    ClosingBamReader reader(path);
+    BamTools::BamAlignment read;
+    while (reader.GetNextAlignment(read)) {
+        names.push_back(read.Name + suffix(read));
+    }
+    return names;
+}
+
+// Marks a read with an unmapped mate as mapped (m) or unmapped (u) with a
+// mapped mate, or the first (1) or second (2) of a pair both unmapped
+static std::string read_role(const BamTools::BamAlignment &read) {
+    return read.IsMapped() ? "m" : read.IsMateMapped() ? "u" : read.IsFirstMate() ? "1" : "2";
+}
+
+static BamTools::BamAlignment half_mapped_read(const std::string &name, int32_t position, bool mapped) {
+    BamTools::BamAlignment read;
+    read.Name = name;
+    read.RefID = read.MateRefID = 0;
+    read.Position = read.MatePosition = position;
+    read.AlignmentFlag = mapped ? 0x1 | 0x8 : 0x1 | 0x4;
+    read.QueryBases = std::string(50, 'A');
+    if (mapped) read.CigarData.emplace_back('M', 50);
+    return read;
+}
+
+// A read with an unmapped mate in the role read_role gives it, placed at
+// position if half-mapped
+static BamTools::BamAlignment unmapped_mate_read(const std::string &name, char role, int32_t position = -1) {
+    if (role == 'm' || role == 'u') return half_mapped_read(name, position, role == 'm');
+    BamTools::BamAlignment read;
+    read.Name = name;
+    read.AlignmentFlag = 0x1 | 0x4 | 0x8 | (role == '1' ? 0x40 : 0x80);
+    read.QueryBases = std::string(50, 'A');
+    return read;
+}
+
+TEST(test, test_filter_bam_budget) {
+    // A third of 20000 subject reads have mates in the query, far more names
+    // than 64 KB holds, so they are joined partition by partition
+    TestFiles files;
+    std::vector<BamTools::BamAlignment> subject, query;
+    for (int i = 0; i < 20000; ++i) {
+        subject.push_back(half_mapped_read("read" + std::to_string(i * 7919 % 20000), i, true));
+        if (i % 3 == 0) query.push_back(half_mapped_read(subject.back().Name, i, false));
+    }
+    std::reverse(query.begin(), query.end());
+    files.Write("join_query", query);
+    files.Write("join_subject", subject);
+
+    auto no_suffix = [](const BamTools::BamAlignment &) { return std::string(); };
+    testing::internal::CaptureStdout();
+    int expected = filter_bam(files.Path("join_query"), files.Path("join_subject"), files.dir,
+                              files.Path("unbounded"), FilterOptions(), ReaderOptions(), WriterOptions(-1, 0, false));
+    testing::internal::GetCapturedStdout();
+    ASSERT_EQ(expected, int(query.size()));
+    auto expected_names = read_names(files.Path("unbounded"), no_suffix);
+    for (auto options : {FilterOptions(1000000, true, false, 1 << 16), FilterOptions(1000000, true, true, 1 << 16),
+                         FilterOptions(1000000, true, false, 1 << 16, 3),
+                         FilterOptions(1000000, false, false, 1 << 16, 3)}) {
+        testing::internal::CaptureStdout();
+        int written = filter_bam(files.Path("join_query"), files.Path("join_subject"), files.dir,
+                                 files.Path("budget"), options, ReaderOptions(), WriterOptions(-1, 0, false));
+        std::string log = testing::internal::GetCapturedStdout();
+        ASSERT_NE(log.find("partitioning"), std::string::npos);
+        ASSERT_EQ(written, expected);
+        auto names = read_names(files.Path("budget"), no_suffix);
+        if (!options.preserve_order) {
+            ASSERT_TRUE(std::is_permutation(names.begin(), names.end(), expected_names.begin()));
+        }
+        else {
+            ASSERT_EQ(names, expected_names);
+        }
+        // The partition files are named after the subject
+        ASSERT_EQ(files.Count("join_subject_"), 0);
+    }
+}
+
+TEST(test, test_half_mapped_stream) {
+    // Pairs a-c, g and h have coverage 2 or more; d is covered once, and e and f have no mates
+    std::vector<std::pair<std::string, int32_t>> reads{
+            {"a", 100}, {"a", -100}, {"b", 100}, {"b", -100}, {"c", 120}, {"c", -120},
+            {"d", 300}, {"d", -300}, {"e", 400}, {"f", -400},
+            {"g", 500}, {"h", 500}, {"h", -500}, {"g", -500}};
+    TestFiles files;
+    std::vector<BamTools::BamAlignment> alignments;
+    for (const auto &read : reads) {
+        alignments.push_back(half_mapped_read(read.first, std::abs(read.second), read.second > 0));
+    }
+    files.Write("stream", alignments);
+    {
+        ClosingBamReader reader(files.Path("stream"));
+        auto mapped_writer = files.Writer("stream_mapped");
+        auto unmapped_writer = files.Writer("stream_unmapped");
+        HalfMappedStream stream(*mapped_writer, *unmapped_writer, 2);
+        BamRecordView read;
+        while (reader.GetNextRecordView(read)) {
+            stream.Add(read);
+        }
+        stream.Finish();
+        ASSERT_EQ(stream.Regions().size(), 2);
+        ASSERT_EQ(stream.UnmappedWritten(), stream.MappedWritten());
+        ASSERT_EQ(stream.MappedWritten(), 5);
+    }
+    {
+        // A read that isn't placed with its mate can't be paired in the stream
+        BamTools::BamAlignment misplaced = half_mapped_read("i", 600, false);
+        misplaced.MatePosition = 700;
+        ClosingBamReader reader(files.Write("misplaced", {misplaced}));
+        auto mapped_writer = files.Writer("misplaced_mapped");
+        HalfMappedStream stream(*mapped_writer, *mapped_writer, 2);
+        BamRecordView read;
+        ASSERT_TRUE(reader.GetNextRecordView(read));
+        ASSERT_THROW(stream.Add(read), StreamOrderException);
+    }
+
+    auto no_suffix = [](const BamTools::BamAlignment &) { return std::string(); };
+    ASSERT_EQ(read_names(files.Path("stream_mapped"), no_suffix),
+              std::vector<std::string>({"a", "b", "c", "g", "h"}));
+    ASSERT_EQ(read_names(files.Path("stream_unmapped"), no_suffix),
+              std::vector<std::string>({"a", "b", "c", "h", "g"}));
+}
+
+TEST(test, test_mate_window) {
+    // Mates of a and c are within two reads of each other, b's and d's aren't, and e has no mate
+    std::vector<std::pair<std::string, char>> reads{
+            {"a", '1'}, {"a", '2'}, {"b", '1'}, {"c", '1'}, {"c", '2'}, {"d", '2'},
+            {"e", '1'}, {"b", '2'}, {"d", '1'}};
+    TestFiles files;
+    std::vector<BamTools::BamAlignment> alignments;
+    for (const auto &read : reads) {
+        alignments.push_back(unmapped_mate_read(read.first, read.second));
+    }
+    {
+        ClosingBamReader reader(files.Write("window", alignments));
+        auto paired = files.Writer("paired");
+        auto first = files.Writer("first");
+        auto second = files.Writer("second");
+        MateWindow window(*paired, *first, *second, 2);
+        BamRecordView read;
+        while (reader.GetNextRecordView(read)) {
+            window.Add(read);
+        }
+        window.Finish();
+        ASSERT_EQ(window.PairedWritten(), 4);
+        ASSERT_EQ(window.UnpairedWritten(), 5);
+    }
+
+    std::vector<std::string> names;
+    for (auto name : {"paired", "first", "second"}) {
+        auto file_names = read_names(files.Path(name), read_role);
+        names.insert(names.end(), file_names.begin(), file_names.end());
+    }
+    ASSERT_EQ(names, std::vector<std::string>({"a1", "a2", "c1", "c2", "b1", "e1", "d1", "d2", "b2"}));
+}
+
+// What pair_mates_of wrote: the names and roles of the reads, both-unmapped,
+// then mapped, then unmapped, and the temporary files made by the time all
+// the reads had been added
+struct PairedMates {
+    std::vector<std::string> names;
+    unsigned long n_both = 0;
+    unsigned long n_half_mapped = 0;
+    size_t n_temporaries = 0;
+};
+
+typedef std::function<std::unique_ptr<CollatedMates>(ClosingBamWriter &, HalfMappedSorter &)> MakeMates;
+
+// Pairs the reads in path with mates, and then the half-mapped ones by coverage
+static PairedMates pair_mates_of(const TestFiles &files, const fs::path &path, HalfMappedSorter &sorter,
+                                 MakeMates make_mates) {
+    PairedMates paired;
+    {
+        ClosingBamReader reader(path);
+        auto both = files.Writer("both");
+        auto mapped = files.Writer("mapped");
+        auto unmapped = files.Writer("unmapped");
+        auto mates = make_mates(*both, sorter);
+        BamRecordView read;
+        while (reader.GetNextRecordView(read)) {
+            mates->Add(read);
+        }
+        paired.n_temporaries = files.Count("tmp_");
+        mates->Finish();
+        paired.n_both = mates->BothWritten();
+
+        HalfMappedStream stream(*mapped, *unmapped, 1);
+        sorter.Finish(stream);
+        stream.Finish();
+        paired.n_half_mapped = stream.MappedWritten();
+    }
+    for (auto name : {"both", "mapped", "unmapped"}) {
+        auto names = read_names(files.Path(name), read_role);
+        paired.names.insert(paired.names.end(), names.begin(), names.end());
+    }
+    return paired;
+}
+
+TEST(test, test_collated_mates) {
+    // a and e are both unmapped, with e's first mate repeated; b, c and f are half-mapped, and d has no mate
+    std::vector<std::pair<std::string, char>> reads{
+            {"a", '1'}, {"a", '2'}, {"b", 'm'}, {"b", 'u'}, {"c", 'u'}, {"c", 'm'}, {"d", '1'},
+            {"e", '1'}, {"e", '1'}, {"e", '2'}, {"f", 'm'}, {"f", 'u'}};
+    const std::map<std::string, int32_t> positions{{"b", 120}, {"c", 100}, {"f", 100}};
+    TestFiles files;
+    std::vector<BamTools::BamAlignment> alignments;
+    for (const auto &read : reads) {
+        int32_t position = positions.count(read.first) ? positions.at(read.first) : -1;
+        alignments.push_back(unmapped_mate_read(read.first, read.second, position));
+    }
+    PairedMates paired;
+    {
+        // A limit of one byte writes each pair to a run of its own, to be merged
+        HalfMappedSorter sorter(files.dir, files.header, files.references, 1,
+                                WriterOptions(-1, 0, false));
+        paired = pair_mates_of(files, files.Write("collated", alignments), sorter,
+                               [](ClosingBamWriter &both, HalfMappedSorter &half_mapped) {
+                                   return std::make_unique<CollatedMates>(both, half_mapped);
+                               });
+    }
+    // f's pair is only found by Finish, so b's and c's runs were written before it
+    ASSERT_EQ(paired.n_temporaries, 2);
+    ASSERT_EQ(files.Count("tmp_"), 0);
+    ASSERT_EQ(paired.n_both, 4);
+    ASSERT_EQ(paired.n_half_mapped, 3);
+    ASSERT_EQ(paired.names, std::vector<std::string>({"a1", "a2", "e1", "e2", "cm", "fm", "bm", "cu", "fu", "bu"}));
+}
+
+TEST(test, test_bucketed_mates) {
+    // The reads of test_collated_mates, out of order
+    std::vector<std::pair<std::string, char>> reads{
+            {"f", 'u'}, {"a", '1'}, {"b", 'm'}, {"e", '1'}, {"c", 'u'}, {"d", '1'}, {"e", '2'},
+            {"a", '2'}, {"e", '1'}, {"c", 'm'}, {"b", 'u'}, {"f", 'm'}};
+    const std::map<std::string, int32_t> positions{{"b", 120}, {"c", 100}, {"f", 100}};
+    TestFiles files;
+    std::vector<BamTools::BamAlignment> alignments;
+    for (const auto &read : reads) {
+        int32_t position = positions.count(read.first) ? positions.at(read.first) : -1;
+        alignments.push_back(unmapped_mate_read(read.first, read.second, position));
+    }
+    PairedMates paired;
+    {
+        HalfMappedSorter sorter(files.dir, files.header, files.references);
+        // A limit of one byte splits the reads into three buckets after the first
+        paired = pair_mates_of(files, files.Write("unsorted", alignments), sorter,
+                               [&files](ClosingBamWriter &both, HalfMappedSorter &half_mapped) {
+                                   return std::make_unique<BucketedMates>(both, half_mapped, files.dir, files.header,
+                                                                          files.references, 1, 3, ReaderOptions(),
+                                                                          WriterOptions(-1, 0, false));
+                               });
+    }
+    ASSERT_EQ(paired.n_temporaries, 3);
+    ASSERT_EQ(files.Count("tmp_"), 0);
+    ASSERT_EQ(paired.n_both, 4);
+    ASSERT_EQ(paired.n_half_mapped, 3);
+
+    // Names come out collated in no particular order, but pairs are written first mate first,
+    // and half-mapped reads by position
+    std::vector<std::string> &names = paired.names;
+    ASSERT_EQ(names.size(), 10);
+    ASSERT_EQ(names[0].substr(0, 1), names[1].substr(0, 1));
+    ASSERT_EQ(names[0].back(), '1');
+    std::sort(names.begin(), names.begin() + 4);
+    std::sort(names.begin() + 4, names.begin() + 6);
+    std::sort(names.begin() + 7, names.begin() + 9);
+    ASSERT_EQ(names, std::vector<std::string>({"a1", "a2", "e1", "e2", "cm", "fm", "bm", "cu", "fu", "bu"}));
+
+    // Taken for collated, they're caught when e comes back after d
+    HalfMappedSorter sorter(files.dir, files.header, files.references);
+    ASSERT_THROW(pair_mates_of(files, files.Path("unsorted"), sorter,
+                               [](ClosingBamWriter &both, HalfMappedSorter &half_mapped) {
+                                   return std::make_unique<CollatedMates>(both, half_mapped);
+                               }),
+                 CollationOrderException);
+}
+
+TEST(test, test_exact_name_set) {
+    ExactNameSet names;
+    std::vector<std::string> all;
+    for (int i = 0; i < 5000; ++i) {
+        // Half of them pack, and the others go in the arena
+        all.push_back("SOLEXA-1GA-2_2_FC20EMB:5:" + std::to_string(i) + (i % 4 < 2 ? ":1:2" : ""));
+        names.Insert(all.back().data(), all.back().size(), name_fingerprint(all.back().data(), all.back().size()));
+    }
+    ASSERT_EQ(names.Size(), 5000);
+    // Erase every other name; the rest must still be found past the gaps
+    for (int i = 0; i < 5000; i += 2) {
+        auto &name = all[i];
+        ASSERT_TRUE(names.Erase(name.data(), name.size(), name_fingerprint(name.data(), name.size())));
+    }
+    for (int i = 0; i < 5000; ++i) {
+        auto &name = all[i];
+        ASSERT_EQ(names.Contains(name.data(), name.size(), name_fingerprint(name.data(), name.size())), i % 2 == 1);
+    }
+    ASSERT_EQ(names.Size(), 2500);
+}
+
+TEST(test, test_name_codec) {
+    NameCodec codec;
+    PackedName packed, again;
+    std::string name = "SOLEXA-1GA-2_2_FC20EMB:5:195:284:685", unpacked;
+    ASSERT_TRUE(codec.Pack(name.data(), name.size(), packed, true) == NameForm::Packed);
+    codec.Unpack(packed, unpacked);
+    ASSERT_EQ(unpacked, name);
+    name = "A00123:8:H3VXYDSXX:1:1101:10000:1000";
+    ASSERT_TRUE(codec.Pack(name.data(), name.size(), again, false) == NameForm::Unknown);
+    ASSERT_TRUE(codec.Pack(name.data(), name.size(), again, true) == NameForm::Packed);
+    codec.Unpack(again, unpacked);
+    ASSERT_EQ(unpacked, name);
+    // Leading zeros, missing fields and out of range fields don't pack
+    for (std::string raw : {"SOLEXA:5:195:284:0685", "SOLEXA:195:284:685", "5:195:284:685", "SOLEXA:5:195:284:",
+                            "SOLEXA:70000:195:284:685", "SOLEXA:5:195:284:4294967296"}) {
+        ASSERT_TRUE(codec.Pack(raw.data(), raw.size(), packed, true) == NameForm::Raw) << raw;
+    }
+
+    // Once the prefixes run out, a name with a new one is Raw when looked up, as when added
+    NameCodec full(1);
+    ASSERT_TRUE(full.Pack(name.data(), name.size(), packed, true) == NameForm::Packed);
+    name = "SOLEXA-1GA-2_2_FC20EMB:5:195:284:685";
+    ASSERT_TRUE(full.Pack(name.data(), name.size(), packed, true) == NameForm::Raw);
+    ASSERT_TRUE(full.Pack(name.data(), name.size(), packed, false) == NameForm::Raw);
+}
+
+TEST(test, test_bloom_filter) {
+    BloomFilter filter;
+    filter.Reset(10000);
+    for (uint64_t i = 0; i < 10000; ++i) {
+        filter.Insert(name_fingerprint(reinterpret_cast<const char *>(&i), 8));
+    }
+    int false_positives = 0;
+    for (uint64_t i = 0; i < 20000; ++i) {
+        bool present = filter.MayContain(name_fingerprint(reinterpret_cast<const char *>(&i), 8));
+        if (i < 10000) ASSERT_TRUE(present);
+        else false_positives += present;
+    }
+    ASSERT_LT(false_positives, 300);  // About 1% expected
+}
+
+TEST(test, test_alignment_core) {
+    ClosingBamReader full_reader(fs::path("../data/subject.bam"));
+    ClosingBamReader core_reader(fs::path("../data/subject.bam"));
+    BamTools::BamAlignment full, core;
+    int n = 0;
+    while (full_reader.GetNextAlignment(full)) {
+        ASSERT_TRUE(core_reader.GetNextAlignmentCore(core));
+        ASSERT_EQ(core.Position, full.Position);
+        ASSERT_EQ(core.AlignmentFlag, full.AlignmentFlag);
+        ASSERT_EQ(core.Length, full.Length);
+        ASSERT_EQ(core.CigarData.size(), full.CigarData.size());
+        ASSERT_TRUE(core.Name.empty() && core.QueryBases.empty() && core.TagData.empty());
+        n++;
+    }
+    ASSERT_FALSE(core_reader.GetNextAlignmentCore(core));
+    ASSERT_GT(n, 0);
+
+    // Core-only alignments are written back whole, with any changes to their core
+    TestFiles files;
+    {
+        ClosingBamReader reader(fs::path("../data/subject.bam"));
+        auto writer = files.Writer("core");
+        while (reader.GetNextAlignmentCore(core)) {
+            core.MapQuality = 7;
+            ASSERT_TRUE(writer->SaveAlignment(core));
+        }
+    }
+    ClosingBamReader checker(files.Path("core"));
+    ClosingBamReader expected_reader(fs::path("../data/subject.bam"));
+    BamTools::BamAlignment written;
+    while (expected_reader.GetNextAlignment(full)) {
+        ASSERT_TRUE(checker.GetNextAlignment(written));
+        ASSERT_EQ(written.Name, full.Name);
+        ASSERT_EQ(written.QueryBases, full.QueryBases);
+        ASSERT_EQ(written.Qualities, full.Qualities);
+        ASSERT_EQ(written.TagData, full.TagData);
+        ASSERT_EQ(written.CigarData.size(), full.CigarData.size());
+        ASSERT_EQ(written.Position, full.Position);
+        ASSERT_EQ(written.MapQuality, 7);
+    }
+    ASSERT_FALSE(checker.GetNextAlignment(written));
+
+    // Without the record it was read from, a core has nothing to write a name or sequence from
+    core.AlignedBases.clear();
+    ASSERT_FALSE(files.Writer("bare")->SaveAlignment(core));
+}
+
+// Serialised records of path, as read with options
+static std::vector<std::vector<char>> read_records(const fs::path &path,
+                                                   const ReaderOptions &options = ReaderOptions()) {
+    std::vector<std::vector<char>> records;
+    ClosingBamReader reader(path, options);
+    BamRecord record;
+    while (reader.GetNextRecord(record)) {
+        records.push_back(record.data);
+    }
+    return records;
+}
+
+static std::string file_contents(const fs::path &path) {
+    std::ifstream in(path.string(), std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+static size_t count_blocks(const fs::path &path) {
+    BgzfReader reader(path.string());
+    BgzfBlock block;
+    size_t n = 0;
+    while (reader.ReadCompressedBlock(block)) n++;
+    return n;
+}
+
+// subject.bam copied 3000 times over, in a block per copy, for threaded
+// readers and writers to keep thousands of blocks in order
+static fs::path many_blocks_bam(const TestFiles &files) {
+    std::vector<fs::path> copies(3000, fs::path("../data/subject.bam"));
+    EXPECT_TRUE(concatenate_bam(copies, files.Path("many_blocks"), WriterOptions(-1, 0, false)));
+    return files.Path("many_blocks");
+}
+
+TEST(test, test_threaded_reader) {
+    TestFiles files;
+    auto path = many_blocks_bam(files);
+    ASSERT_GE(count_blocks(path), 3000);
+    auto expected = read_records(path);
+    ASSERT_EQ(expected.size(), 30000);
+    ASSERT_EQ(read_records(path, ReaderOptions(4)), expected);
+}
+
+TEST(test, test_reader_input_modes) {
+    TestFiles files;
+    auto path = many_blocks_bam(files);
+    auto expected = read_records(path);
+    ASSERT_EQ(expected.size(), 30000);
+    // Memory-mapped, then asynchronous read-ahead
+    for (auto options : {ReaderOptions(2, true), ReaderOptions(0, true), ReaderOptions(2, false, 3),
+                         ReaderOptions(0, false, 1)}) {
+        ASSERT_EQ(read_records(path, options), expected);
+    }
+}
+
+TEST(test, test_threaded_writer) {
+    TestFiles files;
+    auto records = read_records(many_blocks_bam(files));
+    // Written out in full 64 KB blocks, so tens of them
+    for (int threads : {0, 4}) {
+        auto writer = files.Writer("threads" + std::to_string(threads), WriterOptions(-1, threads, false));
+        for (const auto &data : records) {
+            writer->SaveRecord(BamRecordView(data.data(), uint32_t(data.size())));
+        }
+    }
+    ASSERT_GT(count_blocks(files.Path("threads0")), 10);
+    ASSERT_EQ(file_contents(files.Path("threads4")), file_contents(files.Path("threads0")));
+    ASSERT_EQ(read_records(files.Path("threads4")), records);
+}
+
+TEST(test, test_deflate_codec) {
+    // A full writer block of random bytes, which deflate can't shrink, and the
+    // largest payload a BGZF block can hold, of bytes it can
+    std::vector<char> random(BGZF_DEFAULT_BLOCK_SIZE), repetitive(BGZF_MAX_BLOCK_SIZE);
+    uint64_t state = 88172645463325252ULL;
+    for (auto &c : random) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        c = char(state);
+    }
+    for (size_t i = 0; i < repetitive.size(); ++i) {
+        repetitive[i] = "ACGT"[(i * i >> 5) & 3];
+    }
+    const size_t capacity = BGZF_MAX_BLOCK_SIZE - BGZF_BLOCK_HEADER_LENGTH - BGZF_BLOCK_FOOTER_LENGTH;
+    std::vector<char> compressed(capacity), decompressed;
+    for (int level : {-1, 0, 6, 9}) {
+        DeflateCodec codec(level);
+        for (const auto *data : {&random, &repetitive}) {
+            size_t size = codec.Compress(data->data(), data->size(), compressed.data(), capacity);
+            if (level == 0 && data == &repetitive) {
+                // Stored, the largest payload overflows the block, which is why writers fill less
+                ASSERT_EQ(size, 0);
+                continue;
+            }
+            ASSERT_GT(size, 0) << level;
+            if (level != 0 && data == &repetitive) {
+                ASSERT_LT(size, data->size() / 2) << level;
+            }
+            decompressed.assign(data->size(), 0);
+            ASSERT_TRUE(codec.Decompress(compressed.data(), size, decompressed.data(), decompressed.size()));
+            ASSERT_EQ(decompressed, *data) << level;
+            // Only the exact length inflates
+            decompressed.pop_back();
+            ASSERT_FALSE(codec.Decompress(compressed.data(), size, decompressed.data(), decompressed.size()));
+        }
+        ASSERT_EQ(codec.Compress(random.data(), random.size(), compressed.data(), 1000), 0);
+    }
+    ASSERT_THROW(DeflateCodec(10), DeflateCodecException);
+    ASSERT_EQ(DeflateCodec::Crc32("123456789", 9), 0xcbf43926);
+}
+
+TEST(test, test_compression_level) {
+    std::vector<std::vector<char>> expected;
+    {
+        ClosingBamReader reader(fs::path("../data/subject.bam"));
+        BamRecord record;
+        while (reader.GetNextRecord(record)) {
+            expected.push_back(record.data);
+        }
+    }
+
+    TestFiles files;
+    std::map<int, uintmax_t> sizes;
+    for (int level : {0, 9}) {
+        {
+            auto writer = files.Writer("level" + std::to_string(level), WriterOptions(level, 0, false));
+            for (const auto &data : expected) {
+                writer->SaveRecord(BamRecordView(data.data(), uint32_t(data.size())));
+            }
+        }
+        auto path = files.Path("level" + std::to_string(level));
+        sizes[level] = fs::file_size(path);
+
+        std::vector<std::vector<char>> records;
+        {
+            ClosingBamReader checker(path);
+            BamRecord record;
+            while (checker.GetNextRecord(record)) {
+                records.push_back(record.data);
+            }
+        }
+        ASSERT_EQ(records, expected);
+
+        // Level 0 stores its deflate blocks (BTYPE 00, after the 18-byte BGZF header)
+        if (level == 0) {
+            BgzfReader blocks(path.string());
+            BgzfBlock block;
+            int n_blocks = 0;
+            while (blocks.ReadCompressedBlock(block)) {
+                ASSERT_EQ((block.CompressedData()[18] >> 1) & 3, 0);
+                n_blocks++;
+            }
+            ASSERT_GT(n_blocks, 0);
+        }
+    }
+    ASSERT_LT(sizes[9], sizes[0]);
+}
+
+// A BAI index as read back from disk
+struct BaiContents {
+    struct Reference {
+        std::map<uint32_t, std::vector<std::pair<uint64_t, uint64_t>>> bins;
+        std::vector<uint64_t> intervals;
+    };
+    std::vector<Reference> references;
+    uint64_t n_no_coordinate = 0;
+};
+
+static BaiContents read_bai(const fs::path &path) {
+    std::ifstream in(path.string(), std::ios::binary);
+    auto next = [&in](size_t size) {
+        uint64_t value = 0;
+        in.read(reinterpret_cast<char *>(&value), size);
+        return value;
+    };
+    BaiContents bai;
+    char magic[4];
+    in.read(magic, 4);
+    EXPECT_EQ(std::string(magic, 4), std::string("BAI\1", 4));
+    bai.references.resize(next(4));
+    for (auto &ref : bai.references) {
+        for (uint64_t n_bins = next(4); n_bins > 0; --n_bins) {
+            auto &chunks = ref.bins[uint32_t(next(4))];
+            for (uint64_t n_chunks = next(4); n_chunks > 0; --n_chunks) {
+                uint64_t begin = next(8);
+                chunks.emplace_back(begin, next(8));
+            }
+        }
+        ref.intervals.resize(next(4));
+        for (auto &offset : ref.intervals) offset = next(8);
+    }
+    bai.n_no_coordinate = next(8);
+    EXPECT_TRUE(bool(in));
+    return bai;
+}
+
+TEST(test, test_bai_index) {
+    // Reads over several linear index windows of chr1, starting a few windows in, with one
+    // long deletion spanning windows and some unmapped reads placed with their mates; then
+    // some reads on chr2, and unplaced reads at the end. Enough to fill several BGZF blocks.
+    std::vector<BamTools::BamAlignment> reads;
+    for (int i = 0; i < 2000; ++i) {
+        BamTools::BamAlignment read = half_mapped_read("r" + std::to_string(i), 40000 + i * 97, i % 7 != 0);
+        read.QueryBases = std::string(100, 'A');
+        if (read.IsMapped()) read.CigarData = {BamTools::CigarOp('M', 100)};
+        if (i == 600) read.CigarData = {BamTools::CigarOp('M', 50), BamTools::CigarOp('D', 40000),
+                                        BamTools::CigarOp('M', 50)};
+        reads.push_back(read);
+    }
+    for (int i = 0; i < 500; ++i) {
+        BamTools::BamAlignment read = half_mapped_read("s" + std::to_string(i), i * 30, true);
+        read.RefID = read.MateRefID = 1;
+        reads.push_back(read);
+    }
+    for (int i = 0; i < 50; ++i) {
+        reads.push_back(unmapped_mate_read("t" + std::to_string(i), i % 2 ? '1' : '2'));
+    }
+    TestFiles files;
+    {
+        auto writer = files.Writer("indexed", WriterOptions(-1, 0, true));
+        for (const auto &read : reads) writer->SaveAlignment(read);
+    }
+
+    // Where each record starts and ends, as virtual offsets
+    struct Placed {
+        int32_t ref_id, position, end;
+        uint16_t bin;
+        bool mapped;
+        uint64_t begin, stop;
+    };
+    std::vector<Placed> records;
+    {
+        ClosingBamReader reader(files.Path("indexed"));
+        BamRecord record;
+        for (uint64_t begin = reader.Tell(); reader.GetNextRecord(record); begin = reader.Tell()) {
+            records.push_back(Placed{record.RefID(), record.Position(), record.GetEndPosition(), record.Bin(),
+                                     record.IsMapped(), begin, reader.Tell()});
+        }
+    }
+    ASSERT_EQ(records.size(), reads.size());
+    ASSERT_GT(records.back().begin >> 16, 4 * (records.front().begin >> 16));
+
+    BaiContents bai = read_bai(fs::path(files.Path("indexed").string() + ".bai"));
+    ASSERT_EQ(bai.references.size(), files.references.size());
+    ASSERT_EQ(bai.n_no_coordinate, 50);
+    for (size_t ref_id = 2; ref_id < bai.references.size(); ++ref_id) {
+        ASSERT_TRUE(bai.references[ref_id].bins.empty());
+        ASSERT_TRUE(bai.references[ref_id].intervals.empty());
+    }
+
+    for (int32_t ref_id : {0, 1}) {
+        const auto &ref = bai.references[ref_id];
+        std::vector<const Placed *> placed;
+        for (const auto &record : records) {
+            if (record.ref_id == ref_id) placed.push_back(&record);
+        }
+
+        // Every record lies within a chunk of its bin
+        for (const Placed *record : placed) {
+            ASSERT_TRUE(ref.bins.count(record->bin));
+            const auto &chunks = ref.bins.at(record->bin);
+            ASSERT_TRUE(std::any_of(chunks.begin(), chunks.end(), [record](const std::pair<uint64_t, uint64_t> &c) {
+                return c.first <= record->begin && record->stop <= c.second;
+            }));
+        }
+
+        // The metadata pseudo-bin spans the reference's records and counts them
+        const auto &metadata = ref.bins.at(37450);
+        ASSERT_EQ(metadata.size(), 2);
+        ASSERT_EQ(metadata[0].first, placed.front()->begin);
+        ASSERT_EQ(metadata[0].second, placed.back()->stop);
+        size_t n_mapped = std::count_if(placed.begin(), placed.end(), [](const Placed *r) { return r->mapped; });
+        ASSERT_EQ(metadata[1].first, n_mapped);
+        ASSERT_EQ(metadata[1].second, placed.size() - n_mapped);
+
+        // Each window of the linear index starts at the first record overlapping it, placed unmapped
+        // reads covering just their position; empty windows take the offset of the window before
+        std::vector<uint64_t> expected;
+        for (const Placed *record : placed) {
+            int32_t stop = record->mapped ? record->end : record->position + 1;
+            size_t last = size_t(stop - 1) >> 14;
+            if (expected.size() <= last) expected.resize(last + 1, 0);
+            for (size_t i = size_t(record->position) >> 14; i <= last; ++i) {
+                if (expected[i] == 0) expected[i] = record->begin;
+            }
+        }
+        for (size_t i = 0; i < expected.size(); ++i) {
+            if (expected[i] == 0) expected[i] = i > 0 ? expected[i - 1] : placed.front()->begin;
+        }
+        ASSERT_EQ(ref.intervals, expected);
+
+        // Jumping to a position's window lands on a record, with none overlapping the position before it
+        for (int32_t position : {0, 20000, 45000, 100020, 120000, 200000, 230000}) {
+            size_t window = size_t(position) >> 14;
+            if (window >= ref.intervals.size()) continue;
+            auto landed = std::find_if(placed.begin(), placed.end(), [&](const Placed *r) {
+                return r->begin == ref.intervals[window];
+            });
+            ASSERT_NE(landed, placed.end());
+            for (auto it = placed.begin(); it != landed; ++it) {
+                int32_t stop = (*it)->mapped ? (*it)->end : (*it)->position + 1;
+                ASSERT_FALSE((*it)->position <= position && position < stop);
+            }
+        }
+    }
+}
+
+TEST(test, test_record_pipe) {
+    std::vector<std::string> expected;
+    std::vector<BamRecord> records;
+    {
+        ClosingBamReader reader(fs::path("../data/subject.bam"));
+        BamRecordView view;
+        while (reader.GetNextRecordView(view)) {
+            expected.emplace_back(view.Name(), view.NameLength());
+            records.emplace_back();
+            records.back().Assign(view);
+        }
+    }
+
+    // Batches of a byte hold one record each, so a queue of two fills up many times over
+    std::vector<std::string> names;
+    {
+        RecordPipe pipe([&names](const BamRecordView &read) { names.emplace_back(read.Name(), read.NameLength()); },
+                        2, 1);
+        for (int i = 0; i < 10; ++i) {
+            for (const auto &record : records) pipe.Add(record);
+        }
+        pipe.Close();
+    }
+    ASSERT_EQ(names.size(), expected.size() * 10);
+    ASSERT_TRUE(std::equal(expected.begin(), expected.end(), names.end() - expected.size()));
+
+    // What the consumer throws comes back to the producer
+    RecordPipe failing([](const BamRecordView &) { throw StreamOrderException("out of order"); }, 2, 1);
+    ASSERT_THROW({
+        for (int i = 0; i < 10; ++i) {
+            for (const auto &record : records) failing.Add(record);
+        }
+        failing.Close();
+    }, StreamOrderException);
+}
+
+TEST(test, test_concatenate_bam) {
+    std::vector<std::string> expected;
+    BamTools::BamAlignment read;
+    {
+        ClosingBamReader reader(fs::path("../data/subject.bam"));
+        while (reader.GetNextAlignment(read)) {
+            expected.push_back(read.Name);
+        }
+    }
+    auto once = expected;
+    expected.insert(expected.end(), once.begin(), once.end());
+
+    std::vector<fs::path> inputs{fs::path("../data/subject.bam"), fs::path("../data/subject.bam")};
+    ASSERT_TRUE(concatenate_bam(inputs, fs::path("../data/concatenated.bam"), WriterOptions(-1, 2)));
+
+    std::vector<std::string> names;
+    {
+        ClosingBamReader checker(fs::path("../data/concatenated.bam"));
+        while (checker.GetNextAlignment(read)) {
+            names.push_back(read.Name);
+        }
+    }
+    fs::remove(fs::path("../data/concatenated.bam"));
+
+    ASSERT_EQ(names, expected);
+}